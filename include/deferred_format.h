@@ -0,0 +1,400 @@
+#pragma once
+
+#include <string>
+#include <string.h>
+#include "format_shim.h"
+
+/** \file deferred_format.h
+
+ printf-style formatting split in two halves: the caller only packs the raw argument
+ values into a compact binary buffer, the (expensive) formatting happens later,
+ usually on another thread.
+
+ @code
+   std::string args;
+   tp::deferred_args(args).add_all(42, L"abc", 1.5);     // cheap: copies the values
+   ...
+   std::wstring text;
+   tp::deferred_render(L"%d %s %.2f", args, text);     // "42 abc 1.50"
+ @endcode
+
+ the format string itself is not copied, it must outlive the buffer (normally it is a literal).
+ arguments are rendered by the conversion in the format string, not by the packed type,
+ so a mismatched %d/%s never reads garbage the way a real va_list would.
+ */
+
+namespace tp
+{
+    //! packs argument values into a byte buffer, one tag byte + payload per argument
+    class deferred_args
+    {
+    public:
+        enum tag
+        {
+            tag_int = 'i',      // signed, stored as 64 bits
+            tag_uint = 'u',     // unsigned, stored as 64 bits
+            tag_double = 'd',
+            tag_pointer = 'p',
+            tag_str = 's',      // char string: 32 bit length + chars
+            tag_wstr = 'S',     // wchar_t string: 32 bit length + wchar_ts
+        };
+
+        explicit deferred_args(std::string& buf) : m_buf(buf)
+        {
+        }
+
+        void add(bool v)                { add_int(v ? 1 : 0); }
+        void add(char v)                { add_int(v); }
+        void add(signed char v)         { add_int(v); }
+        void add(unsigned char v)       { add_uint(v); }
+        void add(short v)               { add_int(v); }
+        void add(unsigned short v)      { add_uint(v); }
+        void add(int v)                 { add_int(v); }
+        void add(unsigned int v)        { add_uint(v); }
+        void add(long v)                { add_int(v); }
+        void add(unsigned long v)       { add_uint(v); }
+        void add(long long v)           { add_int(v); }
+        void add(unsigned long long v)  { add_uint(v); }
+        void add(float v)               { add_double(v); }
+        void add(double v)              { add_double(v); }
+        void add(long double v)         { add_double(static_cast<double>(v)); }
+        void add(const void * v)        { put(tag_pointer, &v, sizeof(v)); }
+        void add(const char * v)        { add_str(tag_str, v, v ? strlen(v) : 0); }
+        void add(char * v)              { add(static_cast<const char *>(v)); }
+        void add(const wchar_t * v)     { add_str(tag_wstr, v, v ? wcslen(v) : 0); }
+        void add(wchar_t * v)           { add(static_cast<const wchar_t *>(v)); }
+        void add(const std::string& v)  { add_str(tag_str, v.c_str(), v.length()); }
+        void add(const std::wstring& v) { add_str(tag_wstr, v.c_str(), v.length()); }
+        template <typename P>
+        void add(P * v)                 { add(static_cast<const void *>(v)); }
+
+#if (_MSC_VER >= 1800)
+        void add_all()
+        {
+        }
+        template <typename A, typename... R>
+        void add_all(const A& a, const R&... r)
+        {
+            add(a);
+            add_all(r...);
+        }
+#endif
+
+    private:
+        deferred_args& operator=(const deferred_args&);
+
+        void add_int(long long v)
+        {
+            put(tag_int, &v, sizeof(v));
+        }
+        void add_uint(unsigned long long v)
+        {
+            put(tag_uint, &v, sizeof(v));
+        }
+        void add_double(double v)
+        {
+            put(tag_double, &v, sizeof(v));
+        }
+        template <typename T>
+        void add_str(tag t, const T * s, size_t len)
+        {
+            unsigned int n = static_cast<unsigned int>(len);
+            put(t, &n, sizeof(n));
+            m_buf.append(reinterpret_cast<const char *>(s), len * sizeof(T));
+        }
+        void put(tag t, const void * v, size_t len)
+        {
+            m_buf += static_cast<char>(t);
+            m_buf.append(static_cast<const char *>(v), len);
+        }
+
+        std::string& m_buf;
+    };
+
+    namespace _inner
+    {
+        /** reads back what deferred_args wrote. reading past the end of the buffer (a buffer that
+        * does not come from deferred_args) yields zeros and empty strings
+        */
+        class deferred_reader
+        {
+        public:
+            deferred_reader(const char * p, size_t len) : m_p(p), m_end(p + len)
+            {
+            }
+
+            bool next(char& t)
+            {
+                if (m_p >= m_end) return false;
+                t = *m_p++;
+                return true;
+            }
+
+            template <typename V>
+            V get()
+            {
+                V v = V();
+                if (!left(sizeof(v))) return v;
+                memcpy(&v, m_p, sizeof(v));
+                m_p += sizeof(v);
+                return v;
+            }
+
+            template <typename T>
+            const T * get_str(size_t& len)
+            {
+                len = get<unsigned int>();
+                if (!left(len * sizeof(T))) len = 0;
+                const T * s = reinterpret_cast<const T *>(m_p);
+                m_p += len * sizeof(T);
+                return s;
+            }
+
+            void skip(char t)
+            {
+                size_t len;
+                switch (t)
+                {
+                case deferred_args::tag_str: get_str<char>(len); break;
+                case deferred_args::tag_wstr: get_str<wchar_t>(len); break;
+                default: if (left(8)) m_p += 8; break;
+                }
+            }
+
+        private:
+            //! false and nothing left to read if fewer than \a len bytes are left
+            bool left(size_t len)
+            {
+                if (static_cast<size_t>(m_end - m_p) >= len) return true;
+                m_p = m_end;
+                return false;
+            }
+
+            const char * m_p;
+            const char * m_end;
+        };
+
+        template <typename T>
+        void deferred_append(std::basic_string<T>& out, const T * spec, long long v)
+        {
+            out += static_cast<const T *>(cfmt<T, 128>(spec, v));
+        }
+        //! %c takes an int (a promoted char or wint_t), passing a long long would be undefined
+        template <typename T>
+        void deferred_append_char(std::basic_string<T>& out, const T * spec, int v)
+        {
+            out += static_cast<const T *>(cfmt<T, 128>(spec, v));
+        }
+        template <typename T>
+        void deferred_append(std::basic_string<T>& out, const T * spec, double v)
+        {
+            out += static_cast<const T *>(cfmt<T, 128>(spec, v));
+        }
+        template <typename T>
+        void deferred_append(std::basic_string<T>& out, const T * spec, const void * v)
+        {
+            out += static_cast<const T *>(cfmt<T, 128>(spec, v));
+        }
+        template <typename T, typename S>
+        void deferred_append(std::basic_string<T>& out, const T * spec, const S * s, size_t len)
+        {
+            std::basic_string<S> str(s, len);
+            out += static_cast<const T *>(cfmt<T, 256>(spec, str.c_str()));
+        }
+        inline void deferred_append_plain(std::string& out, const char * s, size_t len)          { out.append(s, len); }
+        inline void deferred_append_plain(std::wstring& out, const wchar_t * s, size_t len)      { out.append(s, len); }
+        //! narrow text is UTF-8 like the rest of the log, not the ANSI code page
+        inline void deferred_append_plain(std::string& out, const wchar_t * s, size_t len)       { out += static_cast<const char *>(w_to_mb<1024>(std::wstring(s, len).c_str(), CP_UTF8)); }
+        inline void deferred_append_plain(std::wstring& out, const char * s, size_t len)         { out += static_cast<const wchar_t *>(mb_to_w<1024>(std::string(s, len).c_str(), CP_UTF8)); }
+    }
+
+    /** appends \a fmt rendered with the values packed by deferred_args to \a out
+    * supports the usual flags, width, precision ('*' included) and length modifiers;
+    * %n is ignored, a conversion without a matching argument is copied verbatim
+    */
+    template <typename T>
+    void deferred_render(const T * fmt, const char * args, size_t args_len, std::basic_string<T>& out)
+    {
+        _inner::deferred_reader rd(args, args_len);
+        const T * p = fmt;
+        while (*p)
+        {
+            const T * q = p;
+            while (*q && *q != '%') q++;
+            out.append(p, static_cast<size_t>(q - p));
+            if (!*q) break;
+
+            // q points to '%', collect the conversion spec without its length modifiers
+            const T * spec_begin = q++;
+            if (*q == '%')
+            {
+                out += static_cast<T>('%');
+                p = q + 1;
+                continue;
+            }
+
+            T spec[96];
+            size_t n = 0;
+            spec[n++] = '%';
+            bool plain = true;
+            bool missing = false;
+            while (*q && n < 40)
+            {
+                T ch = *q;
+                if (ch == '-' || ch == '+' || ch == ' ' || ch == '#' || ch == '.' || (ch >= '0' && ch <= '9'))
+                {
+                    spec[n++] = ch;
+                    plain = false;
+                    q++;
+                }
+                else if (ch == '*')
+                {
+                    char t;
+                    long long w = 0;
+                    if (rd.next(t))
+                    {
+                        if (t == deferred_args::tag_int || t == deferred_args::tag_uint) w = rd.get<long long>();
+                        else rd.skip(t);
+                    }
+                    else
+                    {
+                        missing = true;
+                    }
+                    // '*' takes the width/precision from the arguments, write it into the spec
+                    if (w < 0 && spec[n - 1] == '.')
+                    {
+                        n--;
+                    }
+                    else
+                    {
+                        unsigned long long u = static_cast<unsigned long long>(w < 0 ? -w : w);
+                        T digits[24];
+                        size_t d = 0;
+                        if (w < 0) spec[n++] = '-';
+                        do { digits[d++] = static_cast<T>('0' + u % 10); u /= 10; } while (u && d < 20);
+                        while (d > 0) spec[n++] = digits[--d];
+                    }
+                    plain = false;
+                    q++;
+                }
+                else if (ch == 'h' || ch == 'l' || ch == 'L' || ch == 'I' || ch == 'z' || ch == 'j' || ch == 't' || ch == 'w' || ch == 'q')
+                {
+                    // length modifiers are replaced by the packed type
+                    q++;
+                    if (ch == 'I' && ((q[0] == '6' && q[1] == '4') || (q[0] == '3' && q[1] == '2'))) q += 2;
+                }
+                else
+                {
+                    break;
+                }
+            }
+            T conv = *q;
+            if (!conv)
+            {
+                out.append(spec_begin);
+                break;
+            }
+            p = q + 1;
+            if (conv == 'n') continue;
+
+            char t;
+            if (missing || !rd.next(t))
+            {
+                out.append(spec_begin, static_cast<size_t>(p - spec_begin));
+                continue;
+            }
+
+            switch (conv)
+            {
+            case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c': case 'C':
+                {
+                    long long v = 0;
+                    if (t == deferred_args::tag_int || t == deferred_args::tag_uint) v = rd.get<long long>();
+                    else if (t == deferred_args::tag_double) v = static_cast<long long>(rd.get<double>());
+                    else if (t == deferred_args::tag_pointer) v = reinterpret_cast<long long>(rd.get<const void *>());
+                    else rd.skip(t);
+                    if (conv == 'c' || conv == 'C')
+                    {
+                        spec[n++] = 'c';
+                        spec[n] = 0;
+                        _inner::deferred_append_char(out, spec, static_cast<int>(v));
+                    }
+                    else
+                    {
+                        spec[n++] = 'l';
+                        spec[n++] = 'l';
+                        spec[n++] = conv;
+                        spec[n] = 0;
+                        _inner::deferred_append(out, spec, v);
+                    }
+                }
+                break;
+            case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+                {
+                    double v = 0;
+                    if (t == deferred_args::tag_double) v = rd.get<double>();
+                    else if (t == deferred_args::tag_int) v = static_cast<double>(rd.get<long long>());
+                    else if (t == deferred_args::tag_uint) v = static_cast<double>(rd.get<unsigned long long>());
+                    else rd.skip(t);
+                    spec[n++] = conv;
+                    spec[n] = 0;
+                    _inner::deferred_append(out, spec, v);
+                }
+                break;
+            case 'p':
+                {
+                    const void * v = NULL;
+                    if (t == deferred_args::tag_pointer) v = rd.get<const void *>();
+                    else if (t == deferred_args::tag_int || t == deferred_args::tag_uint) v = reinterpret_cast<const void *>(rd.get<long long>());
+                    else rd.skip(t);
+                    spec[n++] = 'p';
+                    spec[n] = 0;
+                    _inner::deferred_append(out, spec, v);
+                }
+                break;
+            case 's': case 'S': case 'Z':
+                {
+                    size_t len = 0;
+                    if (t == deferred_args::tag_str || t == deferred_args::tag_wstr)
+                    {
+                        bool wide = (t == deferred_args::tag_wstr);
+                        const char * cs = wide ? NULL : rd.get_str<char>(len);
+                        const wchar_t * ws = wide ? rd.get_str<wchar_t>(len) : NULL;
+                        if (plain)
+                        {
+                            if (wide) _inner::deferred_append_plain(out, ws, len);
+                            else _inner::deferred_append_plain(out, cs, len);
+                        }
+                        else
+                        {
+                            // the string is converted first, %ls in a narrow format would use the locale
+                            std::basic_string<T> str;
+                            if (wide) _inner::deferred_append_plain(str, ws, len);
+                            else _inner::deferred_append_plain(str, cs, len);
+                            spec[n++] = sizeof(T) == 1 ? 'h' : 'l';
+                            spec[n++] = 's';
+                            spec[n] = 0;
+                            _inner::deferred_append(out, spec, str.c_str(), str.length());
+                        }
+                    }
+                    else
+                    {
+                        rd.skip(t);
+                        out.append(spec_begin, static_cast<size_t>(p - spec_begin));
+                    }
+                }
+                break;
+            default:
+                rd.skip(t);
+                out.append(spec_begin, static_cast<size_t>(p - spec_begin));
+                break;
+            }
+        }
+    }
+
+    template <typename T>
+    void deferred_render(const T * fmt, const std::string& args, std::basic_string<T>& out)
+    {
+        deferred_render(fmt, args.c_str(), args.length(), out);
+    }
+}
@@ -9,6 +9,8 @@ struct dummy_lock
 {
     void lock() {}
     void unlock() {}
+    bool try_lock() { return true; }
+    bool held_by_caller() const { return false; }
 };
 
 struct critical_section_lock
@@ -45,6 +47,19 @@ struct critical_section_lock
     {
         ::LeaveCriticalSection(&m_cs); 
     }
+
+    //! false if another thread holds the lock, never waits
+    bool try_lock()
+    {
+        return ::TryEnterCriticalSection(&m_cs) != FALSE;
+    }
+
+    //! true if the calling thread already holds the lock; a crash handler
+    //! must not write under a lock its own thread was interrupted in
+    bool held_by_caller() const
+    {
+        return m_cs.OwningThread == reinterpret_cast<HANDLE>(static_cast<ULONG_PTR>(::GetCurrentThreadId()));
+    }
 private:
     CRITICAL_SECTION m_cs;
 };
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <windows.h>
+#include <stddef.h>
+
+#if defined(_M_IX86) || defined(_M_X64)
+// loads already have acquire semantics on x86/x64, only the compiler must not reorder
+#define TP_ACQUIRE_BARRIER() _ReadWriteBarrier()
+#else
+#define TP_ACQUIRE_BARRIER() MemoryBarrier()
+#endif
+
+namespace tp
+{
+    /** bounded multi-producer single-consumer queue, no locks on either side
+    * producers claim a slot with one CAS, fill it in place and then publish it;
+    * the single consumer reads the oldest published slot and releases it.
+    * slots are reused, so members like std::wstring keep their capacity between uses.
+    * positions count up forever and wrap around: they are unsigned and only compared by
+    * their difference, which stays within the capacity
+    * @code
+    *   long ticket;
+    *   if (T* slot = q.begin_push(ticket)) { *slot = v; q.end_push(ticket); }
+    *   ...
+    *   while (T* p = q.front()) { consume(*p); q.pop(); }
+    * @endcode
+    */
+    template <typename T>
+    class mpsc_queue
+    {
+    public:
+        //! capacity is rounded up to a power of 2
+        explicit mpsc_queue(size_t capacity) : m_enqueue_pos(0), m_dequeue_pos(0)
+        {
+            size_t size = 2;
+            while (size < capacity) size *= 2;
+            m_mask = static_cast<ULONG>(size - 1);
+            m_cells = new cell[size];
+            for (ULONG i = 0; i <= m_mask; i++)
+            {
+                m_cells[i].seq = static_cast<LONG>(i);
+            }
+        }
+
+        ~mpsc_queue()
+        {
+            delete [] m_cells;
+        }
+
+        size_t capacity() const
+        {
+            return static_cast<size_t>(m_mask) + 1;
+        }
+
+        //! approximate count of claimed slots, exact only when no producer is active
+        size_t size() const
+        {
+            // the consumer may pass the enqueue position read first
+            ULONG n = position(m_enqueue_pos) - position(m_dequeue_pos);
+            return n <= m_mask + 1 ? static_cast<size_t>(n) : 0;
+        }
+
+        bool empty() const
+        {
+            return front_cell() == NULL;
+        }
+
+        /// producer side: claims a free slot, returns NULL when the queue is full
+        T * begin_push(long& ticket)
+        {
+            ULONG pos = position(m_enqueue_pos);
+            for (;;)
+            {
+                cell * c = &m_cells[pos & m_mask];
+                ULONG seq = position(c->seq);
+                TP_ACQUIRE_BARRIER();
+                // unsigned subtraction wraps, the small difference is then read as signed
+                LONG dif = static_cast<LONG>(seq - pos);
+                if (dif == 0)
+                {
+                    ULONG old = position(::InterlockedCompareExchange(&m_enqueue_pos, static_cast<LONG>(pos + 1), static_cast<LONG>(pos)));
+                    if (old == pos)
+                    {
+                        ticket = static_cast<long>(pos);
+                        return &c->data;
+                    }
+                    pos = old;
+                }
+                else if (dif < 0)
+                {
+                    return NULL;
+                }
+                else
+                {
+                    pos = position(m_enqueue_pos);
+                }
+            }
+        }
+
+        /// producer side: publishes the slot claimed by begin_push to the consumer
+        void end_push(long ticket)
+        {
+            ULONG pos = static_cast<ULONG>(ticket);
+            ::InterlockedExchange(&m_cells[pos & m_mask].seq, static_cast<LONG>(pos + 1));
+        }
+
+        /// consumer side: the oldest published slot, or NULL if there is nothing to read
+        T * front()
+        {
+            cell * c = front_cell();
+            return c ? &c->data : NULL;
+        }
+
+        /// consumer side: the i-th oldest slot (front() is peek(0)), NULL if it is not published yet
+        T * peek(size_t i)
+        {
+            if (i > static_cast<size_t>(m_mask)) return NULL;
+            ULONG pos = position(m_dequeue_pos) + static_cast<ULONG>(i);
+            cell * c = &m_cells[pos & m_mask];
+            ULONG seq = position(c->seq);
+            TP_ACQUIRE_BARRIER();
+            return (seq == pos + 1) ? &c->data : NULL;
+        }
+
+        /// consumer side: releases the slot returned by front()
+        void pop()
+        {
+            ULONG pos = position(m_dequeue_pos);
+            cell * c = &m_cells[pos & m_mask];
+            ::InterlockedExchange(&c->seq, static_cast<LONG>(pos + m_mask + 1));
+            ::InterlockedExchange(&m_dequeue_pos, static_cast<LONG>(pos + 1));
+        }
+
+    private:
+        struct cell
+        {
+            volatile LONG seq;
+            T data;
+        };
+
+        cell * front_cell() const
+        {
+            ULONG pos = position(m_dequeue_pos);
+            cell * c = &m_cells[pos & m_mask];
+            ULONG seq = position(c->seq);
+            TP_ACQUIRE_BARRIER();
+            return (seq == pos + 1) ? c : NULL;
+        }
+
+        //! the Interlocked functions take LONG, positions are used as ULONG
+        static ULONG position(LONG v)
+        {
+            return static_cast<ULONG>(v);
+        }
+
+        mpsc_queue(const mpsc_queue&);
+        mpsc_queue& operator=(const mpsc_queue&);
+
+        cell * m_cells;
+        ULONG m_mask;
+        char m_pad1[64];
+        volatile LONG m_enqueue_pos;
+        char m_pad2[64];
+        volatile LONG m_dequeue_pos;
+    };
+}
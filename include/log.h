@@ -3,23 +3,142 @@
 #include <set>
 #include <list>
 #include <map>
+#include <vector>
 #include <string>
 #include <stdlib.h>
 
+#include <process.h>
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#include <intrin.h>
+#endif
+
 #include "api_wrapper.h"
 #include "lock.h"
+#include "lockfree.h"
+#include "deferred_format.h"
+#include "log_stats.h"
+#include "log_kv.h"
 
 namespace tp
 {
-    // receives formatted log string and write them to file, console, etc...
+    //! the logger works on UTF-8 internally, this converts at the edges that are UTF-16
+    struct log_utf8
+    {
+        static void append(std::string& out, const wchar_t * s, size_t len)
+        {
+            if (len == 0) return;
+            int n = ::WideCharToMultiByte(CP_UTF8, 0, s, static_cast<int>(len), NULL, 0, NULL, NULL);
+            if (n <= 0) return;
+            size_t old_len = out.length();
+            out.resize(old_len + static_cast<size_t>(n));
+            ::WideCharToMultiByte(CP_UTF8, 0, s, static_cast<int>(len), &out[old_len], n, NULL, NULL);
+        }
+        static void append(std::wstring& out, const char * s, size_t len)
+        {
+            if (len == 0) return;
+            int n = ::MultiByteToWideChar(CP_UTF8, 0, s, static_cast<int>(len), NULL, 0);
+            if (n <= 0) return;
+            size_t old_len = out.length();
+            out.resize(old_len + static_cast<size_t>(n));
+            ::MultiByteToWideChar(CP_UTF8, 0, s, static_cast<int>(len), &out[old_len], n);
+        }
+    };
+
+    //! one piece of a log line (UTF-8): a context value, the text or the line break
+    struct log_segment
+    {
+        const char * buf;
+        size_t len;
+        int context_id;
+    };
+
+    /** receives formatted log string and write them to file, console, etc...
+    * the logger produces UTF-8 and calls the narrow write/writev. a device implements the
+    * UTF-8 write(), the UTF-16 one converts and forwards to it by default
+    */
     class log_device
     {
     public:
         virtual bool open() = 0;
         virtual bool close() = 0;
-        virtual size_t write(const wchar_t * buf, size_t len, int context_id) = 0;
         virtual bool flush() = 0;
         virtual ~log_device(){}
+
+        //! flush() and also make the data durable, e.g. FlushFileBuffers. defaults to flush()
+        virtual bool sync()
+        {
+            return flush();
+        }
+
+        //! UTF-16 text, returns the number of wchar_ts written
+        virtual size_t write(const wchar_t * buf, size_t len, int context_id)
+        {
+            std::string str;
+            log_utf8::append(str, buf, len);
+            return write(str.c_str(), str.length(), context_id) == str.length() ? len : 0;
+        }
+
+        //! UTF-8 text, returns the number of bytes written
+        virtual size_t write(const char * buf, size_t len, int context_id) = 0;
+
+        /** scatter-gather write, the logger hands over complete lines here, often many at once.
+        * the default forwards each segment to write(), override it to write the batch in one go
+        */
+        virtual size_t writev(const log_segment * segs, size_t count)
+        {
+            size_t n = 0;
+            for (size_t i = 0; i < count; i++)
+            {
+                n += write(segs[i].buf, segs[i].len, segs[i].context_id);
+            }
+            return n;
+        }
+
+        /** a structured record encoded by log_kv_encode. a device that stores records overrides
+        * this and returns true, the logger then does not write the record as text to it
+        */
+        virtual bool write_record(const char * record, size_t len)
+        {
+            (void)record;
+            (void)len;
+            return false;
+        }
+
+        /** called on the crashing thread by logger::crash_drain before crash_flush: write \a len
+        * bytes of UTF-8 ending in '\n', the crash line, where crash_flush puts the buffers. no
+        * other thread writes through the logger meanwhile, but a thread of the device may still
+        * be busy: skip the line rather than wait for a lock, and allocate nothing. returns false
+        * if the line was not written
+        */
+        virtual bool crash_write(const char * text, size_t len)
+        {
+            (void)text;
+            (void)len;
+            return false;
+        }
+
+        /** called on the crashing thread by logger::crash_drain: hand what is still buffered in
+        * the process to the system, whose file cache survives the crash. the device may be in
+        * the middle of a write on another thread, so take no locks that could be held and
+        * allocate nothing. returns false if there was nothing to do
+        */
+        virtual bool crash_flush()
+        {
+            return false;
+        }
+
+        //! writes the device discarded so far, for the statistics
+        virtual long dropped() const
+        {
+            return 0;
+        }
+
+        //! writes accepted but not yet written by the device, for the statistics
+        virtual size_t pending() const
+        {
+            return 0;
+        }
     };
 
     // log context is one kind of info which is at the beginning of each log line
@@ -31,12 +150,331 @@ namespace tp
 
         int id() const { return m_id; }
         virtual std::wstring value(unsigned int type) const = 0;
+
+        //! true if value() never changes, such a context is rendered only once when it is added
+        virtual bool is_static() const { return false; }
+
+        /** writes the value into \a buf (not 0-terminated, truncated to \a len), returns the length.
+        * the default goes through value(), override it to render without allocating
+        */
+        virtual size_t render(unsigned int type, wchar_t * buf, size_t len) const
+        {
+            std::wstring v = value(type);
+            size_t n = v.length() < len ? v.length() : len;
+            v.copy(buf, n);
+            return n;
+        }
+
+        //! UTF-8 version of render(), this is what the logger calls
+        virtual size_t render(unsigned int type, char * buf, size_t len) const
+        {
+            wchar_t wbuf[256];
+            std::string v;
+            log_utf8::append(v, wbuf, render(type, wbuf, sizeof(wbuf)/sizeof(wbuf[0])));
+            size_t n = v.length() < len ? v.length() : len;
+            v.copy(buf, n);
+            return n;
+        }
     protected:
         log_context& operator=(const log_context&);
     private:
         const int m_id;
     };
 
+#if (_MSC_VER >= 1900)
+#define TP_THREAD_LOCAL thread_local
+#else
+#define TP_THREAD_LOCAL __declspec(thread)
+#endif
+
+    //! name and pre-rendered id of a thread, never changes once published
+    struct log_thread_info
+    {
+        DWORD tid;
+        std::wstring name;      // empty if the thread has no name
+        std::string name_a;
+        std::wstring tid_str;   // "%04u" of tid
+        std::string tid_str_a;
+    };
+
+    //! the thread a log line comes from and when, captured by log() so that contexts rendered
+    //! later on another thread (async mode) still show the logging thread and time
+    struct log_origin
+    {
+        const log_thread_info * thread;
+        int indent;
+        LONGLONG ticks;     // QueryPerformanceCounter when the line was logged, 0 if it is rendered right away
+    };
+
+    /** per thread state for the contexts: each thread caches its log_thread_info and indent depth
+    * in thread local storage. names live in a registry that is only locked when a name is set
+    * or a thread logs for the first time (or after a rename); info objects are kept until exit
+    */
+    class log_thread
+    {
+    public:
+        //! the calling thread's state, as it is captured for a log line
+        static const log_origin& origin()
+        {
+            local_state& st = local();
+            if (st.generation != registry().generation)
+            {
+                refresh(st);
+            }
+            return st.origin;
+        }
+
+        //! the state the contexts render: the logging thread's while the logger renders its line
+        static const log_origin& current()
+        {
+            const log_origin * o = render_origin();
+            return o ? *o : origin();
+        }
+
+        //! set by the logger around rendering a line that was captured on another thread
+        static void set_render_origin(const log_origin * o)
+        {
+            render_origin() = o;
+        }
+
+        static void add_indent(int indent)
+        {
+            local().origin.indent += indent;
+        }
+
+        static bool set_name(DWORD tid, const wchar_t * name)
+        {
+            registry_t& reg = registry();
+            autolocker<critical_section_lock> locker(reg.lock);
+            std::auto_ptr<log_thread_info> info(make_info(tid, name));
+            reg.threads[tid] = info.get();
+            reg.all.push_back(info.release());
+            ::InterlockedIncrement(&reg.generation);
+            return true;
+        }
+
+    private:
+        struct local_state
+        {
+            log_origin origin;
+            LONG generation;
+        };
+
+        struct registry_t
+        {
+            registry_t() : generation(1) {}
+            ~registry_t()
+            {
+                for (std::list<log_thread_info *>::iterator it = all.begin(); it != all.end(); ++it) delete *it;
+            }
+            critical_section_lock lock;
+            std::map<DWORD, const log_thread_info *> threads;
+            std::list<log_thread_info *> all;
+            volatile LONG generation;
+        };
+
+        static registry_t& registry()
+        {
+            static registry_t s_registry;
+            return s_registry;
+        }
+
+        static local_state& local()
+        {
+            static TP_THREAD_LOCAL local_state s_local;
+            return s_local;
+        }
+
+        static const log_origin *& render_origin()
+        {
+            static TP_THREAD_LOCAL const log_origin * s_origin;
+            return s_origin;
+        }
+
+        static log_thread_info * make_info(DWORD tid, const wchar_t * name)
+        {
+            log_thread_info * info = new log_thread_info;
+            info->tid = tid;
+            if (name) info->name = name;
+            log_utf8::append(info->name_a, info->name.c_str(), info->name.length());
+            wchar_t buf[16];
+            info->tid_str.assign(buf, static_cast<size_t>(aw::snprintf_s(buf, sizeof(buf)/sizeof(buf[0]), L"%04u", tid)));
+            log_utf8::append(info->tid_str_a, info->tid_str.c_str(), info->tid_str.length());
+            return info;
+        }
+
+        static void refresh(local_state& st)
+        {
+            DWORD tid = ::GetCurrentThreadId();
+            registry_t& reg = registry();
+            autolocker<critical_section_lock> locker(reg.lock);
+            st.generation = reg.generation;
+            std::map<DWORD, const log_thread_info *>::const_iterator it = reg.threads.find(tid);
+            if (it != reg.threads.end())
+            {
+                st.origin.thread = it->second;
+            }
+            else
+            {
+                log_thread_info * info = make_info(tid, NULL);
+                reg.threads[tid] = info;
+                reg.all.push_back(info);
+                st.origin.thread = info;
+            }
+        }
+    };
+
+    namespace _inner
+    {
+        //! log_find_eol a byte at a time, where there is no SSE2
+        inline const char * log_find_eol_scalar(const char * p)
+        {
+            while (*p && *p != '\n') p++;
+            return p;
+        }
+
+        //! the first '\n' or the terminating '\0' in \a p, 16 bytes per step with SSE2
+        inline const char * log_find_eol(const char * p)
+        {
+#if defined(_M_IX86) || defined(_M_X64)
+            const __m128i nl = _mm_set1_epi8('\n');
+            const __m128i zero = _mm_setzero_si128();
+            // aligned loads never cross a page, so reading a few bytes past the '\0' is safe
+            size_t misalign = reinterpret_cast<size_t>(p) & 15;
+            const char * block = p - misalign;
+            __m128i v = _mm_load_si128(reinterpret_cast<const __m128i *>(block));
+            unsigned long mask = static_cast<unsigned long>(_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, zero))));
+            mask &= 0xFFFFu << misalign;
+            for (;;)
+            {
+                unsigned long index;
+                if (_BitScanForward(&index, mask)) return block + index;
+                block += 16;
+                v = _mm_load_si128(reinterpret_cast<const __m128i *>(block));
+                mask = static_cast<unsigned long>(_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, zero))));
+            }
+#else
+            return log_find_eol_scalar(p);
+#endif
+        }
+
+        //! a device's context list compiled into one renderer: static contexts are rendered at
+        //! compile time, dynamic ones render straight into the caller's buffer on each log call
+        class log_prefix
+        {
+        public:
+            struct span
+            {
+                size_t offset;
+                size_t length;
+                int context_id;
+            };
+
+            //! room reserved in the buffer for each dynamic context
+            enum { dynamic_budget = 256 };
+
+            log_prefix() : m_dynamic_count(0)
+            {
+            }
+
+            void compile(const std::list<log_context*>& lcs)
+            {
+                m_segs.clear();
+                m_static.clear();
+                m_dynamic_count = 0;
+                for (std::list<log_context*>::const_iterator it = lcs.begin(); it != lcs.end(); ++it)
+                {
+                    segment seg;
+                    seg.id = (*it)->id();
+                    seg.lc = NULL;
+                    seg.offset = m_static.length();
+                    seg.length = 0;
+                    if ((*it)->is_static())
+                    {
+                        std::wstring v = (*it)->value(0);
+                        log_utf8::append(m_static, v.c_str(), v.length());
+                        seg.length = m_static.length() - seg.offset;
+                    }
+                    else
+                    {
+                        seg.lc = *it;
+                        m_dynamic_count++;
+                    }
+                    m_segs.push_back(seg);
+                }
+            }
+
+            size_t segment_count() const
+            {
+                return m_segs.size();
+            }
+
+            //! buffer size render() needs to never truncate a static context
+            size_t max_length() const
+            {
+                return m_static.length() + m_dynamic_count * dynamic_budget;
+            }
+
+            //! renders the whole prefix into buf, spans receives segment_count() entries
+            size_t render(unsigned int type, char * buf, size_t len, span * spans) const
+            {
+                size_t pos = 0;
+                for (size_t i = 0; i < m_segs.size(); i++)
+                {
+                    const segment& seg = m_segs[i];
+                    size_t n;
+                    if (seg.lc)
+                    {
+                        size_t room = len - pos;
+                        n = seg.lc->render(type, buf + pos, room < dynamic_budget ? room : static_cast<size_t>(dynamic_budget));
+                    }
+                    else
+                    {
+                        n = seg.length < len - pos ? seg.length : len - pos;
+                        m_static.copy(buf + pos, n, seg.offset);
+                    }
+                    spans[i].offset = pos;
+                    spans[i].length = n;
+                    spans[i].context_id = seg.id;
+                    pos += n;
+                }
+                return pos;
+            }
+
+        private:
+            struct segment
+            {
+                const log_context * lc;     // NULL for static segments, which live in m_static
+                int id;
+                size_t offset;
+                size_t length;
+            };
+
+            std::vector<segment> m_segs;
+            std::string m_static;
+            size_t m_dynamic_count;
+        };
+    }
+
+    /** when the logger flushes the devices. by default (interval_ms == 0) every log call that
+    * asks for a flush flushes right away. with an interval, flush requests of all threads are
+    * coalesced into group commits: one flush per device at most every interval_ms, earlier once
+    * max_bytes are pending. no line stays unflushed longer than interval_ms.
+    * types in force_mask are always flushed and synced by the calling thread (errors)
+    */
+    struct log_flush_policy
+    {
+        unsigned int interval_ms;
+        size_t max_bytes;           // 0: no bytes threshold
+        bool sync;                  // group commits call log_device::sync() instead of flush()
+        unsigned int force_mask;
+
+        explicit log_flush_policy(unsigned int interval = 0, size_t bytes = 0, bool durable = false, unsigned int force = 0)
+            : interval_ms(interval), max_bytes(bytes), sync(durable), force_mask(force)
+        {
+        }
+    };
+
     namespace _inner
     {
         // singleton
@@ -47,11 +485,16 @@ namespace tp
             typedef T mtlock_t;
             typedef logger<T> mytype_t;
             typedef autolocker<T> locker_t;
-            mtlock_t m_lock;
+            mtlock_t m_lock;            // serializes the writes to the devices
+            mtlock_t m_config_lock;     // serializes add_device/remove_device/add_context
             static std::auto_ptr<mytype_t> s_inst;
 
-            logger()
+            logger() : m_table(new device_table), m_epoch(0), m_type_mask(0), m_queue(NULL), m_consumer(NULL), m_consumer_tid(0), m_wakeup(NULL), m_stop(0), m_consumer_idle(0)
+                , m_flusher(NULL), m_flusher_event(NULL), m_flusher_stop(0), m_dirty_mask(0), m_unflushed(0)
+                , m_stats_enabled(0), m_reporter(NULL), m_reporter_event(NULL), m_reporter_stop(0), m_report_interval(0), m_report_type(0)
             {
+                m_readers[0] = 0;
+                m_readers[1] = 0;
             }
 
             logger(const logger&);
@@ -60,23 +503,182 @@ namespace tp
             typedef std::list<log_context*> lcs_t;
             struct device_info
             {
+                log_device * ld;
+                log_device_stats * stats;   // shared by all copies of the table
                 unsigned int mask;
                 lcs_t lcs;
+                log_prefix prefix;
                 bool auto_delete;
                 bool padding[3];
             };
 
-            typedef std::map<log_device*, device_info> lds_t;
-            lds_t m_lds;
-            CRITICAL_SECTION m_cs;
+            /** the devices are kept in an immutable table. a change copies the table, publishes
+            * the copy with one pointer exchange and frees the old one after a grace period,
+            * so writers never block the threads that are logging (RCU)
+            */
+            struct device_table
+            {
+                std::vector<device_info> devices;
+
+                int find(const log_device * ld) const
+                {
+                    for (size_t i = 0; i < devices.size(); i++)
+                    {
+                        if (devices[i].ld == ld) return static_cast<int>(i);
+                    }
+                    return -1;
+                }
+            };
+            device_table * volatile m_table;
+
+            // readers register in the counter of the current epoch's parity, see read_section
+            volatile LONG m_epoch;
+            volatile LONG m_readers[2];
+
+            //! keeps the current table alive while it is used
+            class read_section
+            {
+            public:
+                explicit read_section(mytype_t& owner) : m_owner(owner)
+                {
+                    for (;;)
+                    {
+                        m_epoch = owner.m_epoch;
+                        ::InterlockedIncrement(&owner.m_readers[m_epoch & 1]);
+                        if (owner.m_epoch == m_epoch) break;
+                        // the writer flipped the epoch meanwhile and may not wait for us
+                        ::InterlockedDecrement(&owner.m_readers[m_epoch & 1]);
+                    }
+                    m_table = owner.m_table;
+                }
+                ~read_section()
+                {
+                    ::InterlockedDecrement(&m_owner.m_readers[m_epoch & 1]);
+                }
+                const device_table& table() const
+                {
+                    return *m_table;
+                }
+            private:
+                read_section(const read_section&);
+                read_section& operator=(const read_section&);
+
+                mytype_t& m_owner;
+                const device_table * m_table;
+                LONG m_epoch;
+            };
+
+            // union of the masks in m_table, read without the lock to drop unwanted types early
+            volatile LONG m_type_mask;
+
+            // async mode: producers enqueue records, m_consumer drains them into the devices
+            // a record carries either the final text or, when a format is set, the packed arguments.
+            // wide input is queued as it is, the consumer converts it to UTF-8.
+            // a structured record (kv) is queued encoded in args
+            struct log_record
+            {
+                unsigned int type;
+                bool flush;
+                bool wide;
+                bool kv;
+                const char * fmt;
+                const wchar_t * wfmt;
+                std::string text;
+                std::wstring wtext;
+                std::string args;
+                log_origin origin;
+            };
+            typedef mpsc_queue<log_record> queue_t;
+            queue_t * volatile m_queue;
+            HANDLE m_consumer;
+            unsigned int m_consumer_tid;
+            HANDLE m_wakeup;
+            volatile LONG m_stop;
+            volatile LONG m_consumer_idle;
+
+            // group commits, see log_flush_policy. m_dirty_mask and m_unflushed are changed under m_lock
+            log_flush_policy m_policy;
+            HANDLE m_flusher;
+            HANDLE m_flusher_event;
+            volatile LONG m_flusher_stop;
+            volatile LONG m_dirty_mask;
+            size_t m_unflushed;
+
+            // statistics, see log_stats. the per type counts are kept by the thread that writes
+            volatile LONG m_stats_enabled;
+            log_thread_counters m_thread_counters;
+            HANDLE m_reporter;
+            HANDLE m_reporter_event;
+            volatile LONG m_reporter_stop;
+            unsigned int m_report_interval;
+            unsigned int m_report_type;
+
+            //! adds the time spent in a log call to the calling thread's histogram
+            class enqueue_timer
+            {
+            public:
+                explicit enqueue_timer(mytype_t& owner) : m_owner(owner), m_start(owner.m_stats_enabled ? log_ticks() : 0)
+                {
+                }
+                ~enqueue_timer()
+                {
+                    if (m_start)
+                    {
+                        m_owner.m_thread_counters.local().enqueue_latency.add(log_ticks_to_ns(log_ticks() - m_start));
+                    }
+                }
+            private:
+                enqueue_timer& operator=(const enqueue_timer&);
+                mytype_t& m_owner;
+                LONGLONG m_start;
+            };
+
+            // one log call (or one queued record) to be written
+            struct log_entry
+            {
+                unsigned int type;
+                const char * text;
+                const log_origin * origin;
+                const char * record;        // encoded structured record or NULL
+                size_t record_len;
+            };
+
+            // the lines of the entries being written, split once and shared by all devices
+            struct line_span
+            {
+                const char * text;
+                size_t length;
+            };
+            struct entry_lines
+            {
+                size_t first;       // index in m_lines
+                size_t count;
+                size_t length;      // of the whole text
+            };
+
+            // scratch space for building the segments of a batch, only used under m_lock
+            std::vector<line_span> m_lines;
+            std::vector<entry_lines> m_entry_lines;
+            std::vector<char> m_prefix_buf;
+            std::vector<log_prefix::span> m_prefix_spans;
+            std::vector<log_segment> m_segments;
+
+            // consumer thread only, stop_async uses them once the consumer is gone
+            std::vector<log_entry> m_batch;
+            std::vector<std::string> m_render_bufs;
+            std::wstring m_wrender_buf;
 
         public:
             ~logger()
             {
-                while (m_lds.size() > 0)
+                start_stats_report(0, 0);
+                stop_async();
+                set_flush_policy(log_flush_policy());
+                while (m_table->devices.size() > 0)
                 {
-                    remove_device(m_lds.begin()->first);
+                    remove_device(m_table->devices.front().ld);
                 }
+                delete m_table;
             }
 
             static mytype_t& instance()
@@ -90,88 +692,836 @@ namespace tp
 
             void add_device(log_device * ld, unsigned int mask, bool auto_delete)
             {
-                locker_t locker(m_lock);
+                locker_t locker(m_config_lock);
+
+                if (m_table->find(ld) >= 0) return;
+                ld->open();
 
                 device_info di;
+                di.ld = ld;
+                di.stats = new log_device_stats;
+                di.stats->device = ld;
                 di.auto_delete = auto_delete;
                 di.mask = mask;
+                device_table * t = new device_table(*m_table);
+                t->devices.push_back(di);
+                delete publish_table(t);
+            }
+
+            void remove_device(log_device * ld)
+            {
+                locker_t locker(m_config_lock);
+
+                int index = m_table->find(ld);
+                if (index < 0) return;
+
+                device_table * t = new device_table(*m_table);
+                device_info di = t->devices[index];
+                t->devices.erase(t->devices.begin() + index);
+                delete publish_table(t);
 
-                lds_t::iterator it = m_lds.find(ld);
-                if (it == m_lds.end())
+                // nobody uses the device any more
+                ld->close();
+                if (di.auto_delete) delete ld;
+                delete di.stats;
+                for (typename lcs_t::const_iterator it = di.lcs.begin(); it != di.lcs.end(); ++it)
                 {
-                    ld->open();
-                    m_lds.insert(lds_t::value_type(ld, di));
+                    delete *it;
                 }
             }
 
-            void remove_device(log_device * ld)
+            bool add_context(log_device * ld, log_context * lc)
             {
-                locker_t locker(m_lock);
+                locker_t locker(m_config_lock);
+
+                int index = m_table->find(ld);
+                if (index < 0) return false;
+
+                device_table * t = new device_table(*m_table);
+                device_info& di = t->devices[index];
+                di.lcs.push_back(lc);
+                di.prefix.compile(di.lcs);
+                delete publish_table(t);
+                return true;
+            }
+
+            //! true if at least one device accepts \a log_type, costs one load and no lock
+            bool enabled(unsigned int log_type) const
+            {
+                return (static_cast<unsigned int>(m_type_mask) & (1u << log_type)) != 0;
+            }
+
+            /** changes when the devices are flushed, see log_flush_policy.
+            * a policy with an interval runs a thread that does the periodic group commits
+            */
+            bool set_flush_policy(const log_flush_policy& policy)
+            {
+                if (m_flusher)
+                {
+                    ::InterlockedExchange(&m_flusher_stop, 1);
+                    ::SetEvent(m_flusher_event);
+                    ::WaitForSingleObject(m_flusher, INFINITE);
+                    ::CloseHandle(m_flusher);
+                    ::CloseHandle(m_flusher_event);
+                    m_flusher = NULL;
+                    m_flusher_event = NULL;
+                }
 
-                lds_t::iterator it = m_lds.find(ld);
-                if (it != m_lds.end())
                 {
-                    const device_info& di = it->second;
+                    read_section rs(*this);
+                    locker_t locker(m_lock);
+                    if (m_dirty_mask) group_commit(rs.table(), m_policy.sync);
+                    m_policy = policy;
+                }
+
+                if (policy.interval_ms == 0) return true;
+
+                m_flusher_stop = 0;
+                m_flusher_event = ::CreateEventW(NULL, FALSE, FALSE, NULL);
+                if (!m_flusher_event) return false;
+                m_flusher = reinterpret_cast<HANDLE>(::_beginthreadex(NULL, 0, &mytype_t::flusher_proc, this, 0, NULL));
+                if (!m_flusher)
+                {
+                    ::CloseHandle(m_flusher_event);
+                    m_flusher_event = NULL;
+                    return false;
+                }
+                return true;
+            }
+
+            /** switch to async mode: log() only copies the text into a lock-free queue of
+            * \a capacity records and a dedicated thread writes them to the devices.
+            * threads may keep logging meanwhile, their lines may then be written out of order
+            */
+            bool start_async(size_t capacity)
+            {
+                locker_t config_locker(m_config_lock);
+                if (m_queue) return true;
+
+                m_stop = 0;
+                m_consumer_idle = 0;
+                m_wakeup = ::CreateEventW(NULL, FALSE, FALSE, NULL);
+                if (!m_wakeup) return false;
 
-                    ld->close();
-                    if (di.auto_delete) delete ld;
-                    for (lcs_t::const_iterator it2 = di.lcs.begin(); it2 != di.lcs.end(); ++it2)
+                queue_t * q = new queue_t(capacity);
+                for (size_t i = 0; i < q->capacity(); i++)
+                {
+                    long ticket;
+                    q->begin_push(ticket)->text.reserve(256);
+                    q->end_push(ticket);
+                    q->pop();
+                }
+                m_queue = q;
+
+                m_consumer = reinterpret_cast<HANDLE>(::_beginthreadex(NULL, 0, &mytype_t::consumer_proc, this, 0, &m_consumer_tid));
+                if (!m_consumer)
+                {
+                    m_queue = NULL;
+                    delete q;
+                    ::CloseHandle(m_wakeup);
+                    m_wakeup = NULL;
+                    return false;
+                }
+                return true;
+            }
+
+            /** writes out all queued records and goes back to synchronous logging.
+            * threads may keep logging meanwhile: new lines are written synchronously, the ones
+            * already being queued are waited for
+            */
+            void stop_async()
+            {
+                locker_t config_locker(m_config_lock);
+                queue_t * q = m_queue;
+                if (!q) return;
+
+                // producers that loaded the queue before it was taken away publish their records
+                // while the consumer still runs, a full queue cannot block them
+                ::InterlockedExchangePointer(reinterpret_cast<void * volatile *>(&m_queue), NULL);
+                wait_for_readers();
+
+                ::InterlockedExchange(&m_stop, 1);
+                ::SetEvent(m_wakeup);
+                ::WaitForSingleObject(m_consumer, INFINITE);
+                ::CloseHandle(m_consumer);
+                ::CloseHandle(m_wakeup);
+                m_consumer = NULL;
+                m_wakeup = NULL;
+
+                // the consumer left nothing behind, unless it stopped in the middle of a batch
+                while (drain(q) > 0)
+                {
+                }
+                delete q;
+            }
+
+            //! blocks until every record queued so far has been written to the devices
+            void wait_async_idle()
+            {
+                read_section rs(*this);
+                queue_t * q = m_queue;
+                if (!q) return;
+                while (!q->empty() || !m_consumer_idle)
+                {
+                    if (!q->empty()) wake_consumer();
+                    ::Sleep(1);
+                }
+            }
+
+            /** last words of a crashing process, see log_crash.h: waits up to \a wait_ms for the
+            * consumer to write what is queued, writes \a text with log_device::crash_write and has
+            * every device push its buffers to the system with log_device::crash_flush. nothing here
+            * waits for a lock or allocates: the line, copied to the stack and without the prefix,
+            * is left out when another thread holds the device lock or the crashing thread was
+            * interrupted inside a write. when the consumer itself crashed, the queued records are lost
+            */
+            void crash_drain(unsigned int log_type, const char * text, unsigned int wait_ms)
+            {
+                queue_t * q = m_queue;
+                if (q && ::GetCurrentThreadId() != m_consumer_tid)
+                {
+                    DWORD start = ::GetTickCount();
+                    while ((!q->empty() || !m_consumer_idle) && ::GetTickCount() - start < wait_ms)
                     {
-                        delete *it2;
+                        if (!q->empty()) wake_consumer();
+                        ::Sleep(1);
                     }
                 }
-                m_lds.erase(it);
+                read_section rs(*this);
+                const device_table& t = rs.table();
+                if (text && enabled(log_type) && !m_lock.held_by_caller() && m_lock.try_lock())
+                {
+                    char line[2048];
+                    size_t len = 0;
+                    while (text[len] && len + 1 < sizeof(line))
+                    {
+                        line[len] = text[len];
+                        len++;
+                    }
+                    line[len++] = '\n';
+                    for (size_t i = 0; i < t.devices.size(); i++)
+                    {
+                        if (t.devices[i].mask & (1 << log_type)) t.devices[i].ld->crash_write(line, len);
+                    }
+                    m_lock.unlock();
+                }
+
+                for (size_t i = 0; i < t.devices.size(); i++)
+                {
+                    t.devices[i].ld->crash_flush();
+                }
             }
 
-            bool add_context(log_device * ld, log_context * lc)
+            //! \a text is UTF-8
+            void log(unsigned int log_type, const char * text, bool flush = false)
             {
-                locker_t locker(m_lock);
+                if (!enabled(log_type)) return;
+                enqueue_timer timer(*this);
 
-                lds_t::iterator it = m_lds.find(ld);
-                if (it != m_lds.end())
+                // the read section keeps the queue alive until the record is published, see stop_async
+                read_section rs(*this);
+                queue_t * q = m_queue;
+                if (q)
                 {
-                    it->second.lcs.push_back(lc);
+                    long ticket;
+                    log_record * r = claim_record(q, ticket);
+                    r->type = log_type;
+                    r->kv = false;
+                    r->flush = flush;
+                    r->wide = false;
+                    r->fmt = NULL;
+                    r->wfmt = NULL;
+                    r->text.assign(text);
+                    publish_record(q, ticket);
+                    return;
                 }
 
-                return false;
+                write_sync(rs.table(), log_type, text, flush);
             }
 
+            //! adapter for UTF-16 text, converted to UTF-8 by the consumer in async mode
             void log(unsigned int log_type, const wchar_t * text, bool flush = false)
             {
+                if (!enabled(log_type)) return;
+                enqueue_timer timer(*this);
+
+                // the read section keeps the queue alive until the record is published, see stop_async
+                read_section rs(*this);
+                queue_t * q = m_queue;
+                if (q)
+                {
+                    long ticket;
+                    log_record * r = claim_record(q, ticket);
+                    r->type = log_type;
+                    r->kv = false;
+                    r->flush = flush;
+                    r->wide = true;
+                    r->fmt = NULL;
+                    r->wfmt = NULL;
+                    r->wtext.assign(text);
+                    publish_record(q, ticket);
+                    return;
+                }
+
+                write_sync(rs.table(), log_type, w_to_mb<1024>(text, CP_UTF8), flush);
+            }
+
+#if (_MSC_VER >= 1800)
+            /** printf-style logging without formatting on the calling thread (in async mode):
+            * only \a fmt and the argument values are queued, the consumer renders the text.
+            * \a fmt must stay valid until then, pass a literal
+            */
+            template <typename... Args>
+            void log_format(unsigned int log_type, bool flush, const char * fmt, const Args&... args)
+            {
+                if (!enabled(log_type)) return;
+                enqueue_timer timer(*this);
+
+                // the read section keeps the queue alive until the record is published, see stop_async
+                read_section rs(*this);
+                queue_t * q = m_queue;
+                if (q)
+                {
+                    long ticket;
+                    log_record * r = claim_record(q, ticket);
+                    r->type = log_type;
+                    r->kv = false;
+                    r->flush = flush;
+                    r->fmt = fmt;
+                    r->wfmt = NULL;
+                    r->args.clear();
+                    deferred_args(r->args).add_all(args...);
+                    publish_record(q, ticket);
+                    return;
+                }
+
+                std::string packed;
+                deferred_args(packed).add_all(args...);
+                std::string text;
+                deferred_render(fmt, packed, text);
+                write_sync(rs.table(), log_type, text.c_str(), flush);
+            }
+
+            template <typename... Args>
+            void log_format(unsigned int log_type, bool flush, const wchar_t * fmt, const Args&... args)
+            {
+                if (!enabled(log_type)) return;
+                enqueue_timer timer(*this);
+
+                // the read section keeps the queue alive until the record is published, see stop_async
+                read_section rs(*this);
+                queue_t * q = m_queue;
+                if (q)
+                {
+                    long ticket;
+                    log_record * r = claim_record(q, ticket);
+                    r->type = log_type;
+                    r->kv = false;
+                    r->flush = flush;
+                    r->fmt = NULL;
+                    r->wfmt = fmt;
+                    r->args.clear();
+                    deferred_args(r->args).add_all(args...);
+                    publish_record(q, ticket);
+                    return;
+                }
+
+                std::string packed;
+                deferred_args(packed).add_all(args...);
+                std::wstring text;
+                deferred_render(fmt, packed, text);
+                write_sync(rs.table(), log_type, w_to_mb<1024>(text.c_str(), CP_UTF8), flush);
+            }
+#endif
+
+            /** starts or stops collecting statistics. collecting costs two QueryPerformanceCounter
+            * calls per log call and per device write. switching it on clears the counters
+            */
+            void enable_stats(bool enable)
+            {
+                if (enable && !m_stats_enabled)
+                {
+                    read_section rs(*this);
+                    locker_t locker(m_lock);
+                    m_thread_counters.clear();
+                    for (size_t d = 0; d < rs.table().devices.size(); d++)
+                    {
+                        log_device_stats * ds = rs.table().devices[d].stats;
+                        ds->writes = ds->lines = ds->bytes = 0;
+                        ds->write_latency.clear();
+                    }
+                }
+                ::InterlockedExchange(&m_stats_enabled, enable ? 1 : 0);
+            }
+
+            //! current statistics, the per thread parts are summed up now
+            void get_stats(log_stats& stats)
+            {
+                stats = log_stats();
+                {
+                    read_section rs(*this);
+                    locker_t locker(m_lock);
+                    for (size_t d = 0; d < rs.table().devices.size(); d++)
+                    {
+                        const device_info& di = rs.table().devices[d];
+                        stats.devices.push_back(*di.stats);
+                        stats.devices.back().dropped = di.ld->dropped();
+                        stats.devices.back().pending = di.ld->pending();
+                    }
+                    queue_t * q = m_queue;
+                    stats.queue_depth = q ? q->size() : 0;
+                }
+                m_thread_counters.sum(stats);
+            }
+
+            /** logs log_stats::to_string() as \a log_type every \a interval_ms, 0 stops it.
+            * switches collecting on
+            */
+            bool start_stats_report(unsigned int interval_ms, unsigned int log_type)
+            {
+                if (m_reporter)
+                {
+                    ::InterlockedExchange(&m_reporter_stop, 1);
+                    ::SetEvent(m_reporter_event);
+                    ::WaitForSingleObject(m_reporter, INFINITE);
+                    ::CloseHandle(m_reporter);
+                    ::CloseHandle(m_reporter_event);
+                    m_reporter = NULL;
+                    m_reporter_event = NULL;
+                }
+                if (interval_ms == 0) return true;
+
+                enable_stats(true);
+                m_report_interval = interval_ms;
+                m_report_type = log_type;
+                m_reporter_stop = 0;
+                m_reporter_event = ::CreateEventW(NULL, FALSE, FALSE, NULL);
+                if (!m_reporter_event) return false;
+                m_reporter = reinterpret_cast<HANDLE>(::_beginthreadex(NULL, 0, &mytype_t::reporter_proc, this, 0, NULL));
+                if (!m_reporter)
+                {
+                    ::CloseHandle(m_reporter_event);
+                    m_reporter_event = NULL;
+                    return false;
+                }
+                return true;
+            }
+
+            /** structured logging, see log_kv.h. devices that store records get the encoded
+            * record, the others the text form. in async mode the text form is rendered by the consumer
+            */
+            void log_kv(unsigned int log_type, const char * msg, const log_kv_field * fields, size_t count, bool flush = false)
+            {
+                if (!enabled(log_type)) return;
+                enqueue_timer timer(*this);
+
+                const log_origin& origin = log_thread::origin();
+                // the read section keeps the queue alive until the record is published, see stop_async
+                read_section rs(*this);
+                queue_t * q = m_queue;
+                if (q)
+                {
+                    long ticket;
+                    log_record * r = claim_record(q, ticket);
+                    r->type = log_type;
+                    r->kv = true;
+                    r->flush = flush;
+                    r->wide = false;
+                    r->fmt = NULL;
+                    r->wfmt = NULL;
+                    r->args.clear();
+                    log_kv_encode(r->args, _inner::log_kv_now(), origin.thread->tid, log_type, msg, fields, count);
+                    publish_record(q, ticket);
+                    return;
+                }
+
+                std::string record;
+                log_kv_encode(record, _inner::log_kv_now(), origin.thread->tid, log_type, msg, fields, count);
+                std::string text;
+                log_kv_text(record, text);
+                write_sync(rs.table(), log_type, text.c_str(), flush, &record);
+            }
+
+        private:
+            static void log_kv_text(const std::string& record, std::string& text)
+            {
+                log_kv_record rec;
+                if (rec.parse(record.c_str(), record.length())) rec.to_text(text);
+            }
+
+            //! \a table is the one of the caller's read section
+            void write_sync(const device_table& table, unsigned int log_type, const char * text, bool flush, const std::string * record = NULL)
+            {
+                log_entry e;
+                e.type = log_type;
+                e.text = text;
+                e.origin = &log_thread::origin();
+                e.record = record ? record->c_str() : NULL;
+                e.record_len = record ? record->length() : 0;
+
                 locker_t locker(m_lock);
+                write_devices(table, &e, 1);
+                commit(table, &e, 1, flush ? 1u << log_type : 0);
+            }
+
+            static unsigned int __stdcall reporter_proc(void * param)
+            {
+                mytype_t * self = static_cast<mytype_t*>(param);
+                for (;;)
+                {
+                    ::WaitForSingleObject(self->m_reporter_event, self->m_report_interval);
+                    if (self->m_reporter_stop) break;
+                    log_stats stats;
+                    self->get_stats(stats);
+                    self->log(self->m_report_type, stats.to_string().c_str(), false);
+                }
+                return 0;
+            }
 
-                for (lds_t::const_iterator it = m_lds.begin(); it != m_lds.end(); ++it)
+            /** called under m_config_lock: makes \a t the current table and returns the old one
+            * once no reader uses it any more
+            */
+            device_table * publish_table(device_table * t)
+            {
+                unsigned int mask = 0;
+                for (size_t i = 0; i < t->devices.size(); i++)
                 {
-                    log_device * ld = it->first;
-                    const device_info& di = it->second;
+                    mask |= t->devices[i].mask;
+                }
+
+                device_table * old = static_cast<device_table *>(::InterlockedExchangePointer(reinterpret_cast<void * volatile *>(&m_table), t));
+                ::InterlockedExchange(&m_type_mask, static_cast<LONG>(mask));
+                wait_for_readers();
+                return old;
+            }
+
+            /** called under m_config_lock after a pointer that readers load (m_table, m_queue) was
+            * replaced: returns once every read_section that may have loaded the old value is gone
+            */
+            void wait_for_readers()
+            {
+                // readers that start after the flip see the new value, wait for the others to leave.
+                // readers of the previous epoch were already waited for by the last call
+                LONG epoch = m_epoch;
+                ::InterlockedExchange(&m_epoch, epoch + 1);
+                while (m_readers[epoch & 1] != 0)
+                {
+                    ::Sleep(1);
+                }
+            }
 
-                    if (di.mask & (1 << log_type))
+            //! fills m_lines and m_entry_lines
+            void split_lines(const log_entry * entries, size_t count)
+            {
+                m_lines.clear();
+                m_entry_lines.resize(count);
+                for (size_t k = 0; k < count; k++)
+                {
+                    entry_lines& el = m_entry_lines[k];
+                    el.first = m_lines.size();
+                    const char * p = entries[k].text;
+                    for (;;)
                     {
-                        const wchar_t * p = text;
-                        const wchar_t * q = text;
-                        do
+                        const char * q = log_find_eol(p);
+                        if (*q == '\n' || q > p)
+                        {
+                            line_span ls = { p, static_cast<size_t>(q - p) };
+                            m_lines.push_back(ls);
+                        }
+                        if (*q == 0)
                         {
-                            if (*q == '\n' || (*q == 0 && q > p))
+                            el.length = static_cast<size_t>(q - entries[k].text);
+                            break;
+                        }
+                        p = q + 1;
+                    }
+                    el.count = m_lines.size() - el.first;
+                }
+            }
+
+            //! hands the lines of all entries to each device with one writev
+            void write_devices(const device_table& table, const log_entry * entries, size_t count)
+            {
+                split_lines(entries, count);
+                for (size_t d = 0; d < table.devices.size(); d++)
+                {
+                    const device_info& di = table.devices[d];
+                    log_device * ld = di.ld;
+                    const log_prefix& lp = di.prefix;
+
+                    // the prefix is rendered once per entry and repeated on every line;
+                    // the buffer is sized up front so the segments can point into it
+                    size_t prefix_len = lp.max_length() + 1;
+                    if (m_prefix_buf.size() < prefix_len * count) m_prefix_buf.resize(prefix_len * count);
+                    if (m_prefix_spans.size() < lp.segment_count() + 1) m_prefix_spans.resize(lp.segment_count() + 1);
+                    m_segments.clear();
+                    size_t lines = 0;
+
+                    for (size_t k = 0; k < count; k++)
+                    {
+                        unsigned int log_type = entries[k].type;
+                        if (!(di.mask & (1 << log_type))) continue;
+                        if (entries[k].record && ld->write_record(entries[k].record, entries[k].record_len)) continue;
+
+                        char * prefix = &m_prefix_buf[k * prefix_len];
+                        log_thread::set_render_origin(entries[k].origin);
+                        lp.render(log_type, prefix, prefix_len, &m_prefix_spans[0]);
+                        log_thread::set_render_origin(NULL);
+
+                        const entry_lines& el = m_entry_lines[k];
+                        for (size_t l = el.first; l < el.first + el.count; l++)
+                        {
+                            for (size_t i = 0; i < lp.segment_count(); i++)
                             {
-                                for (lcs_t::const_iterator it2 = di.lcs.begin(); it2 != di.lcs.end(); ++it2)
-                                {
-                                    std::wstring v = (*it2)->value(log_type);
-                                    ld->write(v.c_str(), v.length(), (*it2)->id());
-                                }
-                                ld->write(p, static_cast<size_t>(q - p), 0);
-                                ld->write(L"\n", 1, 0);
-                                p = q + 1;
+                                const log_prefix::span& sp = m_prefix_spans[i];
+                                log_segment seg = { prefix + sp.offset, sp.length, sp.context_id };
+                                m_segments.push_back(seg);
                             }
-                        } while (*q++);
-                        
-                        if (flush) 
+                            log_segment text_seg = { m_lines[l].text, m_lines[l].length, 0 };
+                            log_segment eol_seg = { "\n", 1, 0 };
+                            m_segments.push_back(text_seg);
+                            m_segments.push_back(eol_seg);
+                        }
+                        lines += el.count;
+                    }
+
+                    if (!m_segments.empty())
+                    {
+                        if (m_stats_enabled)
+                        {
+                            LONGLONG start = log_ticks();
+                            size_t n = ld->writev(&m_segments[0], m_segments.size());
+                            di.stats->write_latency.add(log_ticks_to_ns(log_ticks() - start));
+                            di.stats->writes++;
+                            di.stats->lines += lines;
+                            di.stats->bytes += n;
+                        }
+                        else
                         {
-                            ld->flush();
+                            ld->writev(&m_segments[0], m_segments.size());
                         }
                     }
                 }
             }
 
+            //! flushes (or syncs when \a durable) every device accepting any of the types in type_mask
+            void flush_devices(const device_table& table, unsigned int type_mask, bool durable = false)
+            {
+                for (size_t d = 0; d < table.devices.size(); d++)
+                {
+                    if (table.devices[d].mask & type_mask)
+                    {
+                        if (durable) table.devices[d].ld->sync();
+                        else table.devices[d].ld->flush();
+                    }
+                }
+            }
+
+            /** called under m_lock after the entries were written (m_entry_lines is still valid),
+            * flush_mask has the types that asked for a flush
+            */
+            void commit(const device_table& table, const log_entry * entries, size_t count, unsigned int flush_mask)
+            {
+                if (m_stats_enabled)
+                {
+                    log_thread_counters::block& tc = m_thread_counters.local();
+                    for (size_t i = 0; i < count; i++)
+                    {
+                        unsigned int t = entries[i].type;
+                        if (t >= log_stats::max_types) continue;
+                        tc.lines[t] += m_entry_lines[i].count;
+                        tc.bytes[t] += m_entry_lines[i].length;
+                    }
+                }
+
+                // a forced type is synced whether or not the call asked for a flush
+                unsigned int forced = 0;
+                for (size_t i = 0; i < count; i++) forced |= (1u << entries[i].type) & m_policy.force_mask;
+
+                if (m_policy.interval_ms == 0)
+                {
+                    if (forced) flush_devices(table, forced, true);
+                    if (flush_mask & ~forced) flush_devices(table, flush_mask & ~forced);
+                    return;
+                }
+
+                unsigned int dirty = 0;
+                for (size_t i = 0; i < count; i++)
+                {
+                    dirty |= 1u << entries[i].type;
+                    m_unflushed += m_entry_lines[i].length;
+                }
+                ::InterlockedExchange(&m_dirty_mask, m_dirty_mask | static_cast<LONG>(dirty));
+
+                if (forced)
+                {
+                    group_commit(table, true);
+                }
+                else if (m_policy.max_bytes && m_unflushed >= m_policy.max_bytes)
+                {
+                    group_commit(table, m_policy.sync);
+                }
+            }
+
+            //! called under m_lock: flushes every device that got lines since the last commit
+            void group_commit(const device_table& table, bool durable)
+            {
+                unsigned int mask = static_cast<unsigned int>(m_dirty_mask);
+                ::InterlockedExchange(&m_dirty_mask, 0);
+                m_unflushed = 0;
+                for (size_t d = 0; d < table.devices.size(); d++)
+                {
+                    if (table.devices[d].mask & mask)
+                    {
+                        if (durable) table.devices[d].ld->sync();
+                        else table.devices[d].ld->flush();
+                    }
+                }
+            }
+
+            static unsigned int __stdcall flusher_proc(void * param)
+            {
+                mytype_t * self = static_cast<mytype_t*>(param);
+                while (!self->m_flusher_stop)
+                {
+                    ::WaitForSingleObject(self->m_flusher_event, self->m_policy.interval_ms);
+                    if (self->m_dirty_mask)
+                    {
+                        read_section rs(*self);
+                        locker_t locker(self->m_lock);
+                        if (self->m_dirty_mask) self->group_commit(rs.table(), self->m_policy.sync);
+                    }
+                }
+                return 0;
+            }
+
+            //! a free slot, with the origin of the line (thread, indent and time of the call) filled in
+            log_record * claim_record(queue_t * q, long& ticket)
+            {
+                LONGLONG ticks = log_ticks();
+                log_record * r;
+                while ((r = q->begin_push(ticket)) == NULL)
+                {
+                    // queue is full: make sure the consumer is running and give it the cpu
+                    wake_consumer();
+                    ::SwitchToThread();
+                }
+                r->origin = log_thread::origin();
+                r->origin.ticks = ticks;
+                return r;
+            }
+
+            void publish_record(queue_t * q, long ticket)
+            {
+                q->end_push(ticket);
+                if (m_consumer_idle) wake_consumer();
+            }
+
+            void wake_consumer()
+            {
+                if (::InterlockedCompareExchange(&m_consumer_idle, 0, 1) == 1)
+                {
+                    ::SetEvent(m_wakeup);
+                }
+            }
+
+            static unsigned int __stdcall consumer_proc(void * param)
+            {
+                static_cast<mytype_t*>(param)->consume();
+                return 0;
+            }
+
+            void consume()
+            {
+                queue_t * q = m_queue;
+                for (;;)
+                {
+                    if (drain(q) == 0)
+                    {
+                        if (m_stop) break;
+
+                        // producers only signal the event when they see the idle flag,
+                        // the flag must be visible before the queue is checked again
+                        ::InterlockedExchange(&m_consumer_idle, 1);
+                        if (q->empty() && !m_stop)
+                        {
+                            ::WaitForSingleObject(m_wakeup, 100);
+                        }
+                        ::InterlockedExchange(&m_consumer_idle, 0);
+                    }
+                }
+                ::InterlockedExchange(&m_consumer_idle, 1);
+            }
+
+            //! writes one batch of queued records to the devices, returns the number of records
+            size_t drain(queue_t * q)
+            {
+                const size_t max_batch = 256;
+                if (m_batch.size() < max_batch)
+                {
+                    m_batch.resize(max_batch);
+                    m_render_bufs.resize(max_batch);
+                }
+
+                size_t n = 0;
+                unsigned int flush_mask = 0;
+                for (log_record * r = q->peek(0); r && n < max_batch; r = q->peek(++n))
+                {
+                    m_batch[n].type = r->type;
+                    m_batch[n].origin = &r->origin;
+                    m_batch[n].record = NULL;
+                    m_batch[n].record_len = 0;
+                    std::string& buf = m_render_bufs[n];
+                    if (r->kv)
+                    {
+                        buf.clear();
+                        log_kv_text(r->args, buf);
+                        m_batch[n].text = buf.c_str();
+                        m_batch[n].record = r->args.c_str();
+                        m_batch[n].record_len = r->args.length();
+                    }
+                    else if (r->fmt)
+                    {
+                        buf.clear();
+                        deferred_render(r->fmt, r->args, buf);
+                        m_batch[n].text = buf.c_str();
+                    }
+                    else if (r->wfmt)
+                    {
+                        m_wrender_buf.clear();
+                        deferred_render(r->wfmt, r->args, m_wrender_buf);
+                        buf.clear();
+                        log_utf8::append(buf, m_wrender_buf.c_str(), m_wrender_buf.length());
+                        m_batch[n].text = buf.c_str();
+                    }
+                    else if (r->wide)
+                    {
+                        buf.clear();
+                        log_utf8::append(buf, r->wtext.c_str(), r->wtext.length());
+                        m_batch[n].text = buf.c_str();
+                    }
+                    else
+                    {
+                        m_batch[n].text = r->text.c_str();
+                    }
+                    if (r->flush) flush_mask |= 1u << r->type;
+                }
+
+                if (n > 0)
+                {
+                    {
+                        read_section rs(*this);
+                        locker_t locker(m_lock);
+                        write_devices(rs.table(), &m_batch[0], n);
+                        // one flush per batch instead of one per line
+                        commit(rs.table(), &m_batch[0], n, flush_mask);
+                    }
+                    // the slots hold the texts, release them only after writing
+                    for (size_t i = 0; i < n; i++) q->pop();
+                }
+                return n;
+            }
+
         }; // class logger
 
         template <typename T>
@@ -200,6 +1550,71 @@ namespace tp
         tplogger::instance().add_context(ld, lc);
     }
 
+    //! false if no device accepts \a log_type, lets callers skip building the text
+    inline bool log_enabled(unsigned int log_type)
+    {
+        return tplogger::instance().enabled(log_type);
+    }
+
+    //! see logger::start_async
+    inline bool log_start_async(size_t capacity = 8192)
+    {
+        return tplogger::instance().start_async(capacity);
+    }
+
+    inline void log_stop_async()
+    {
+        tplogger::instance().stop_async();
+    }
+
+    //! structured record from an array of fields, see log_kv.h
+    inline void log_kv(unsigned int log_type, const char * msg, const log_kv_field * fields, size_t count)
+    {
+        tplogger::instance().log_kv(log_type, msg, fields, count);
+    }
+
+#if (_MSC_VER >= 1800)
+    //! tp::log_kv(1, "login", {"user", name}, {"ms", elapsed}), up to 8 fields
+    inline void log_kv(unsigned int log_type, const char * msg,
+        const log_kv_field& f1 = log_kv_field(), const log_kv_field& f2 = log_kv_field(),
+        const log_kv_field& f3 = log_kv_field(), const log_kv_field& f4 = log_kv_field(),
+        const log_kv_field& f5 = log_kv_field(), const log_kv_field& f6 = log_kv_field(),
+        const log_kv_field& f7 = log_kv_field(), const log_kv_field& f8 = log_kv_field())
+    {
+        const log_kv_field fields[] = { f1, f2, f3, f4, f5, f6, f7, f8 };
+        tplogger::instance().log_kv(log_type, msg, fields, sizeof(fields)/sizeof(fields[0]));
+    }
+#endif
+
+    //! see logger::enable_stats
+    inline void log_enable_stats(bool enable)
+    {
+        tplogger::instance().enable_stats(enable);
+    }
+
+    inline void log_get_stats(log_stats& stats)
+    {
+        tplogger::instance().get_stats(stats);
+    }
+
+    //! see logger::crash_drain
+    inline void log_crash_drain(unsigned int log_type, const char * text, unsigned int wait_ms)
+    {
+        tplogger::instance().crash_drain(log_type, text, wait_ms);
+    }
+
+    //! see logger::start_stats_report
+    inline bool log_start_stats_report(unsigned int interval_ms, unsigned int log_type)
+    {
+        return tplogger::instance().start_stats_report(interval_ms, log_type);
+    }
+
+    //! see log_flush_policy, e.g. log_set_flush_policy(log_flush_policy(200, 64 * 1024, false, 1 << 3))
+    inline bool log_set_flush_policy(const log_flush_policy& policy)
+    {
+        return tplogger::instance().set_flush_policy(policy);
+    }
+
     inline void log(unsigned int log_type, const wchar_t * text, bool flush = true)
     {
         tplogger::instance().log(log_type, text, flush);
@@ -208,4 +1623,51 @@ namespace tp
     {
         tplogger::instance().log(0, text, flush);
     }
+
+    //! UTF-8 text, goes to the devices without conversion
+    inline void log(unsigned int log_type, const char * text, bool flush = true)
+    {
+        tplogger::instance().log(log_type, text, flush);
+    }
+    inline void log(const char * text, bool flush = true)
+    {
+        tplogger::instance().log(0, text, flush);
+    }
+
+#if (_MSC_VER >= 1800)
+    //! tp::log_format(1, L"%s: %d", name, value), see logger::log_format
+    template <typename... Args>
+    inline void log_format(unsigned int log_type, const wchar_t * fmt, const Args&... args)
+    {
+        tplogger::instance().log_format(log_type, true, fmt, args...);
+    }
+    template <typename... Args>
+    inline void log_format(unsigned int log_type, const char * fmt, const Args&... args)
+    {
+        tplogger::instance().log_format(log_type, true, fmt, args...);
+    }
+#endif
 };
+
+/** compile-time filtering: types not in TP_LOG_COMPILED_MASK are removed from the build,
+* the arguments of such a statement are not even evaluated. the remaining types cost one
+* load and a branch when no device wants them.
+* @code
+*   #define TP_LOG_COMPILED_MASK 0x0E      // before including log.h: drop type 0 (debug)
+*   TP_LOG(0, L"never compiled in");
+*   TP_LOG_FORMAT(1, "%d items", count);
+* @endcode
+*/
+#ifndef TP_LOG_COMPILED_MASK
+#define TP_LOG_COMPILED_MASK 0xFFFFFFFF
+#endif
+
+#define TP_LOG_TYPE_COMPILED(type) ((TP_LOG_COMPILED_MASK & (1u << (type))) != 0)
+
+#define TP_LOG(type, text) \
+    do { if (TP_LOG_TYPE_COMPILED(type) && tp::log_enabled(type)) tp::log((type), (text)); } while (0)
+
+#if (_MSC_VER >= 1800)
+#define TP_LOG_FORMAT(type, ...) \
+    do { if (TP_LOG_TYPE_COMPILED(type) && tp::log_enabled(type)) tp::log_format((type), __VA_ARGS__); } while (0)
+#endif
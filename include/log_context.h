@@ -40,32 +40,190 @@ public:
         if (!time_fmt) time_fmt = L"%H:%M:%S";
 
         m_time_fmt = time_fmt;
+        log_utf8::append(m_time_fmt_a, m_time_fmt.c_str(), m_time_fmt.length());
         m_show_millisec = show_millisec;
     }
 
-    std::wstring value(unsigned int) const
+    std::wstring value(unsigned int type) const
     {
-        wchar_t time_str[64] = {0};
-        time_t ct = time(NULL);
+        wchar_t time_str[64];
+        return std::wstring(time_str, render(type, time_str, sizeof(time_str)/sizeof(time_str[0])));
+    }
+
+    size_t render(unsigned int, wchar_t * buf, size_t len) const
+    {
+        return render_time(buf, len, m_time_fmt.c_str());
+    }
+
+    size_t render(unsigned int, char * buf, size_t len) const
+    {
+        return render_time(buf, len, m_time_fmt_a.c_str());
+    }
+
+private:
+    template <typename C>
+    size_t render_time(C * buf, size_t len, const C * fmt) const
+    {
+        // 100ns units since 1601, moved back by the age of a line that was queued (async mode)
+        FILETIME ft;
+        ::GetSystemTimeAsFileTime(&ft);
+        unsigned __int64 t = (static_cast<unsigned __int64>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+        LONGLONG logged = log_thread::current().ticks;
+        if (logged) t -= _inner::log_ticks_to_ns(_inner::log_ticks() - logged) / 100;
+
+        time_t ct = static_cast<time_t>((t - 116444736000000000ULL) / 10000000);
+        unsigned int ms = static_cast<unsigned int>(t / 10000 % 1000);
         struct tm otm;
         localtime_s(&otm, &ct);
-        size_t time_len = aw::strftime(time_str, sizeof(time_str)/sizeof(time_str[0]) - 1, m_time_fmt.c_str(), &otm);
-        if (m_show_millisec)
+        size_t time_len = aw::strftime(buf, len, fmt, &otm);
+        if (m_show_millisec && time_len + 4 <= len)
         {
-            SYSTEMTIME st;
-            GetSystemTime(&st);
-            aw::strncpy_s(time_str + time_len, 64 - time_len, cfmt<wchar_t>(L".%03d", st.wMilliseconds), _TRUNCATE);
-            time_str[63] = '\0';
+            buf[time_len++] = '.';
+            buf[time_len++] = static_cast<C>('0' + ms / 100);
+            buf[time_len++] = static_cast<C>('0' + ms / 10 % 10);
+            buf[time_len++] = static_cast<C>('0' + ms % 10);
         }
-        return time_str;
+        return time_len;
     }
 
-private:
     std::wstring m_time_fmt;
+    std::string m_time_fmt_a;
     bool m_show_millisec;
     bool padding[3];
 };
 
+/** lc_time for hot paths: the clock is QueryPerformanceCounter, calibrated against the system
+* time, and the calendar part is formatted once per second and cached. each line only
+* appends the fraction, no allocation and no system calls besides QueryPerformanceCounter.
+* \a digits is the number of fraction digits: 3 for milliseconds, 6 for micro-, 9 for nanoseconds.
+* the cache is not locked, the logger renders contexts under its write lock
+*/
+class lc_hrtime : public log_context
+{
+public:
+    lc_hrtime(const wchar_t * time_fmt = NULL, unsigned int digits = 6) : log_context(LCID_TIME)
+    {
+        if (!time_fmt) time_fmt = L"%H:%M:%S";
+
+        m_time_fmt = time_fmt;
+        log_utf8::append(m_time_fmt_a, m_time_fmt.c_str(), m_time_fmt.length());
+        m_digits = digits > 9 ? 9 : digits;
+
+        LARGE_INTEGER freq;
+        ::QueryPerformanceFrequency(&freq);
+        m_freq = freq.QuadPart;
+        m_last_ns = 0;
+        calibrate();
+    }
+
+    std::wstring value(unsigned int type) const
+    {
+        wchar_t time_str[96];
+        return std::wstring(time_str, render(type, time_str, sizeof(time_str)/sizeof(time_str[0])));
+    }
+
+    size_t render(unsigned int, wchar_t * buf, size_t len) const
+    {
+        return render_time(buf, len, m_cache_w, m_time_fmt.c_str());
+    }
+
+    size_t render(unsigned int, char * buf, size_t len) const
+    {
+        return render_time(buf, len, m_cache_a, m_time_fmt_a.c_str());
+    }
+
+protected:
+    template <typename C>
+    struct second_cache
+    {
+        second_cache() : second(-1), len(0) {}
+        __int64 second;
+        size_t len;
+        C text[64];
+    };
+
+    /** nanoseconds since 1970-01-01 UTC when the line being rendered was logged. a recalibration
+    * may move the time back a little, that is clamped so the times never go backwards
+    */
+    unsigned __int64 now() const
+    {
+        LARGE_INTEGER qpc;
+        ::QueryPerformanceCounter(&qpc);
+        if (qpc.QuadPart - m_base_ticks < 0 || qpc.QuadPart - m_base_ticks > m_freq * 60)
+        {
+            // the two clocks drift apart, line them up again every minute
+            calibrate();
+        }
+
+        // a queued line (async mode) may be older than the calibration
+        LONGLONG logged = log_thread::current().ticks;
+        LONGLONG ticks = (logged ? logged : qpc.QuadPart) - m_base_ticks;
+        unsigned __int64 ns = ticks < 0 ? m_base_ns - to_ns(-ticks) : m_base_ns + to_ns(ticks);
+
+        // drift is a few milliseconds a minute, a bigger step is the clock being set
+        if (ns < m_last_ns && m_last_ns - ns < 1000000000) return m_last_ns;
+        m_last_ns = ns;
+        return ns;
+    }
+
+    unsigned __int64 to_ns(LONGLONG ticks) const
+    {
+        return static_cast<unsigned __int64>(ticks / m_freq * 1000000000 + ticks % m_freq * 1000000000 / m_freq);
+    }
+
+    void calibrate() const
+    {
+        FILETIME ft;
+        LARGE_INTEGER qpc;
+        ::GetSystemTimeAsFileTime(&ft);
+        ::QueryPerformanceCounter(&qpc);
+        unsigned __int64 t = (static_cast<unsigned __int64>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+        m_base_ns = (t - 116444736000000000ULL) * 100;
+        m_base_ticks = qpc.QuadPart;
+    }
+
+    template <typename C>
+    size_t render_time(C * buf, size_t len, second_cache<C>& cache, const C * fmt) const
+    {
+        unsigned __int64 ns = now();
+        __int64 second = static_cast<__int64>(ns / 1000000000);
+        if (second != cache.second)
+        {
+            time_t ct = static_cast<time_t>(second);
+            struct tm otm;
+            localtime_s(&otm, &ct);
+            cache.len = aw::strftime(cache.text, sizeof(cache.text)/sizeof(cache.text[0]), fmt, &otm);
+            cache.second = second;
+        }
+
+        size_t n = cache.len < len ? cache.len : len;
+        memcpy(buf, cache.text, n * sizeof(C));
+        if (m_digits > 0 && n + 1 + m_digits <= len)
+        {
+            unsigned int frac = static_cast<unsigned int>(ns % 1000000000);
+            for (unsigned int i = m_digits; i < 9; i++) frac /= 10;
+            buf[n++] = '.';
+            for (unsigned int i = m_digits; i > 0; i--)
+            {
+                buf[n + i - 1] = static_cast<C>('0' + frac % 10);
+                frac /= 10;
+            }
+            n += m_digits;
+        }
+        return n;
+    }
+
+    std::wstring m_time_fmt;
+    std::string m_time_fmt_a;
+    unsigned int m_digits;
+    LONGLONG m_freq;
+    mutable LONGLONG m_base_ticks;
+    mutable unsigned __int64 m_base_ns;
+    mutable unsigned __int64 m_last_ns;     // the latest time rendered
+    mutable second_cache<wchar_t> m_cache_w;
+    mutable second_cache<char> m_cache_a;
+};
+
 class lc_text : public log_context
 {
 public:
@@ -77,6 +235,10 @@ public:
     {
         return m_text;
     }
+    bool is_static() const
+    {
+        return true;
+    }
 private:
     std::wstring m_text;
 };
@@ -87,6 +249,11 @@ public:
     lc_type(const wchar_t * type_str) : log_context(LCID_TYPE)
     {
         if (type_str) m_type_str = type_str;
+        for (size_t i = 0; i < m_type_str.size(); i++)
+        {
+            m_types_a.push_back(std::string());
+            log_utf8::append(m_types_a.back(), m_type_str.c_str() + i, 1);
+        }
     }
     std::wstring value(unsigned int type) const
     {
@@ -96,26 +263,38 @@ public:
         }
         return L"|";
     }
+    size_t render(unsigned int type, wchar_t * buf, size_t len) const
+    {
+        size_t n = 0;
+        if (type < m_type_str.size() && n < len) buf[n++] = m_type_str[type];
+        if (n < len) buf[n++] = L'|';
+        return n;
+    }
+    size_t render(unsigned int type, char * buf, size_t len) const
+    {
+        size_t n = 0;
+        if (type < m_types_a.size())
+        {
+            n = m_types_a[type].copy(buf, len);
+        }
+        if (n < len) buf[n++] = '|';
+        return n;
+    }
 private:
     std::wstring m_type_str;
+    std::vector<std::string> m_types_a;
 };
 
+//! indents the lines of the logging thread, see add_indent
 class lc_indent : public log_context
 {
-private:
-
-    static tls_value& tls_val()
-    {
-        static tls_value s_tv;
-        return s_tv;
-    }
 public:
     lc_indent() : log_context(LCID_INDENT)
     {
     }
     std::wstring value(unsigned int) const
     {
-        int l = tls_val().get();
+        int l = log_thread::current().indent;
         if (l > 0)
         {
             return std::wstring(static_cast<unsigned int>(l), L' ');
@@ -123,56 +302,90 @@ public:
 
         return L"";
     }
+    size_t render(unsigned int, wchar_t * buf, size_t len) const
+    {
+        return render_indent(buf, len);
+    }
+    size_t render(unsigned int, char * buf, size_t len) const
+    {
+        return render_indent(buf, len);
+    }
+    //! changes the indent depth of the calling thread
     static bool add_indent(int indent)
     {
-        tls_value& tv = tls_val();
-        return tv.set(tv.get() + indent);
+        log_thread::add_indent(indent);
+        return true;
+    }
+private:
+    template <typename C>
+    static size_t render_indent(C * buf, size_t len)
+    {
+        int l = log_thread::current().indent;
+        size_t n = l > 0 ? static_cast<size_t>(l) : 0;
+        if (n > len) n = len;
+        for (size_t i = 0; i < n; i++) buf[i] = ' ';
+        return n;
     }
 };
 
+//! name of the logging thread if it has one, otherwise its id
 class lc_tid : public log_context
 {
-    typedef std::map<DWORD, std::wstring> tns_t;
-
 public:
     lc_tid(const wchar_t * fmt = NULL) : log_context(LCID_TID)
     {
         if (!fmt) fmt = L"%04u";
         m_fmt = fmt;
+        log_utf8::append(m_fmt_a, m_fmt.c_str(), m_fmt.length());
+        // log_thread_info already holds the id rendered with the default format
+        m_default_fmt = (m_fmt == L"%04u");
     }
-    std::wstring value(unsigned int) const
+    std::wstring value(unsigned int type) const
     {
-        const tns_t& tns = get_tns();
-        DWORD tid = GetCurrentThreadId();
-        tns_t::const_iterator it = tns.find(tid);
-        if (it != tns.end())
-        {
-            return it->second;
-        }
-        else
-        {
-            return (const wchar_t*)cz(m_fmt.c_str(), tid);
-        }
+        wchar_t buf[128];
+        return std::wstring(buf, render(type, buf, sizeof(buf)/sizeof(buf[0])));
+    }
+    size_t render(unsigned int, wchar_t * buf, size_t len) const
+    {
+        const log_thread_info * info = log_thread::current().thread;
+        if (!info->name.empty()) return info->name.copy(buf, len);
+        if (m_default_fmt) return info->tid_str.copy(buf, len);
+        return render_tid(buf, len, m_fmt.c_str(), info->tid);
+    }
+    size_t render(unsigned int, char * buf, size_t len) const
+    {
+        const log_thread_info * info = log_thread::current().thread;
+        if (!info->name_a.empty()) return info->name_a.copy(buf, len);
+        if (m_default_fmt) return info->tid_str_a.copy(buf, len);
+        return render_tid(buf, len, m_fmt_a.c_str(), info->tid);
     }
 
+    //! can be called from any thread, the named thread picks the name up with its next line
     static bool set_thread_name(DWORD tid, const wchar_t * name)
     {
-        get_tns()[tid] = name;
-        return true;
+        return log_thread::set_name(tid, name);
     }
 
     static bool set_thread_name(const wchar_t * name)
     {
-        set_thread_name(GetCurrentThreadId(), name);
+        return set_thread_name(GetCurrentThreadId(), name);
     }
 
 private:
     std::wstring m_fmt;
+    std::string m_fmt_a;
+    bool m_default_fmt;
+    bool padding[3];
 
-    static tns_t& get_tns()
+    template <typename C>
+    static size_t render_tid(C * buf, size_t len, const C * fmt, DWORD tid)
     {
-        static tns_t s_tns;
-        return s_tns;
+        C tid_str[64];
+        int n = aw::snprintf_s(tid_str, sizeof(tid_str)/sizeof(tid_str[0]), fmt, tid);
+        size_t tid_len = n > 0 ? static_cast<size_t>(n) : 0;
+        if (tid_len > len) tid_len = len;
+        for (size_t i = 0; i < tid_len; i++) buf[i] = tid_str[i];
+        return tid_len;
     }
 };
 
@@ -188,6 +401,10 @@ public:
     {
         return m_str;
     }
+    bool is_static() const
+    {
+        return true;
+    }
 
 private:
     std::wstring m_str;
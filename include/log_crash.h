@@ -0,0 +1,114 @@
+#pragma once
+
+#include <windows.h>
+#include <signal.h>
+#include <stdio.h>
+#include "log.h"
+#include "opblock.h"
+
+/** \file log_crash.h
+
+ opt-in last words for a crashing process. buffered log output (stdio buffers of the file
+ devices, the async queue, ld_queued and ld_compressed_file blocks) is lost when the process
+ dies, unless every line is flushed, which is what makes logging expensive. with the crash
+ handler installed, an unhandled exception or abort() writes one line
+   crash: exception 0xC0000005 at 0x0040123A, thread 1234, ops: load config -> parse
+ with the op list (see opblock.h) of the crashing thread, drains the async queue and has
+ every device hand its buffers to the system (log_device::crash_flush), whose file cache
+ survives the process.
+
+ @code
+   tp::log_enable_crash_drain(3);
+ @endcode
+
+ the handler formats into fixed buffers and never waits for a lock: the op list is left out
+ when its lock is taken, the crash line is left out for a device that is busy on another
+ thread or in the crashing one (log_device::crash_write), the buffers are pushed anyway.
+ */
+
+namespace tp
+{
+    namespace _inner
+    {
+        struct log_crash_state
+        {
+            unsigned int log_type;
+            unsigned int wait_ms;
+            opmgr * ops;
+            LPTOP_LEVEL_EXCEPTION_FILTER previous_filter;
+            void (__cdecl * previous_abort)(int);
+            bool installed;
+            volatile LONG entered;
+        };
+
+        inline log_crash_state& log_crash()
+        {
+            static log_crash_state s_state = { 0, 0, NULL, NULL, NULL, false, 0 };
+            return s_state;
+        }
+
+        inline void log_crash_write(const char * what)
+        {
+            log_crash_state& s = log_crash();
+            // the first crashing thread drains, the others go on dying
+            if (::InterlockedExchange(&s.entered, 1)) return;
+
+            char text[2048];
+            int n = _snprintf_s(text, _TRUNCATE, "%s, thread %lu, ops: ", what, ::GetCurrentThreadId());
+            if (n < 0) n = static_cast<int>(strlen(text));
+            if (s.ops)
+            {
+                wchar_t ops[1024];
+                s.ops->format_oplist(ops, sizeof(ops)/sizeof(ops[0]), L" -> ");
+                int m = ::WideCharToMultiByte(CP_UTF8, 0, ops, -1, text + n, static_cast<int>(sizeof(text)) - n, NULL, NULL);
+                if (m <= 0) text[n] = 0;
+            }
+            text[sizeof(text) - 1] = 0;
+            log_crash_drain(s.log_type, text, s.wait_ms);
+        }
+
+        inline LONG WINAPI log_crash_filter(EXCEPTION_POINTERS * ep)
+        {
+            char what[64];
+            _snprintf_s(what, _TRUNCATE, "crash: exception 0x%08lX at 0x%p",
+                ep->ExceptionRecord->ExceptionCode, ep->ExceptionRecord->ExceptionAddress);
+            log_crash_write(what);
+
+            LPTOP_LEVEL_EXCEPTION_FILTER previous = log_crash().previous_filter;
+            return previous ? previous(ep) : EXCEPTION_CONTINUE_SEARCH;
+        }
+
+        inline void __cdecl log_crash_abort(int sig)
+        {
+            log_crash_write("crash: abort");
+
+            // returning from the handler lets abort() terminate the process
+            void (__cdecl * previous)(int) = log_crash().previous_abort;
+            if (previous != SIG_DFL && previous != SIG_IGN && previous != SIG_ERR && previous) previous(sig);
+        }
+    }
+
+    /** installs the crash handler: an unhandled exception filter (the previous one is still
+    * called) and a SIGABRT handler. the crash line is logged as \a log_type, the async queue
+    * gets up to \a wait_ms to drain. call it once, after the devices are set up
+    */
+    inline void log_enable_crash_drain(unsigned int log_type, unsigned int wait_ms = 1000)
+    {
+        _inner::log_crash_state& s = _inner::log_crash();
+        s.log_type = log_type;
+        s.wait_ms = wait_ms;
+        // resolved now, creating the service during a crash is not an option
+        try
+        {
+            s.ops = global_service<opmgr>();
+        }
+        catch (...)
+        {
+            s.ops = NULL;
+        }
+        if (s.installed) return;
+        s.installed = true;
+        s.previous_filter = ::SetUnhandledExceptionFilter(&_inner::log_crash_filter);
+        s.previous_abort = signal(SIGABRT, &_inner::log_crash_abort);
+    }
+}
@@ -1,9 +1,18 @@
 #pragma once
 
 #include "log.h"
+#include "log_index.h"
+#include "log_lz.h"
+#include "oss.h"
 #include <windows.h>
+#include <winioctl.h>
+#include <process.h>
 #include <stdio.h>
+#include <io.h>
+#include <time.h>
 #include <string>
+#include <vector>
+#include <algorithm>
 
 namespace tp
 {
@@ -52,25 +61,59 @@ public:
     virtual size_t write(const wchar_t * buf, size_t len, int context_id)
     {
         if (!is_handle_valid(m_handle)) return 0;
-        WORD attr = m_default_attr;
-        if (m_ca.find(context_id) != m_ca.end())
-        {
-            attr = m_ca[context_id];
-        }
-        ::SetConsoleTextAttribute(m_handle, attr);
+        ::SetConsoleTextAttribute(m_handle, get_attr(context_id));
         DWORD wrote;
         ::WriteConsoleW(m_handle, buf, static_cast<DWORD>(len), &wrote, NULL);
         return static_cast<size_t>(wrote);
     }
 
+    //! the console takes UTF-16, returns \a len when all of the text was written
+    virtual size_t write(const char * buf, size_t len, int context_id)
+    {
+        m_buf.clear();
+        log_utf8::append(m_buf, buf, len);
+        return write(m_buf.c_str(), m_buf.length(), context_id) == m_buf.length() ? len : 0;
+    }
+
+    // adjacent segments with the same color go to the console in one call
+    virtual size_t writev(const log_segment * segs, size_t count)
+    {
+        if (!is_handle_valid(m_handle)) return 0;
+        size_t total = 0;
+        size_t i = 0;
+        while (i < count)
+        {
+            WORD attr = get_attr(segs[i].context_id);
+            size_t bytes = 0;
+            m_buf.clear();
+            for (; i < count && get_attr(segs[i].context_id) == attr; i++)
+            {
+                log_utf8::append(m_buf, segs[i].buf, segs[i].len);
+                bytes += segs[i].len;
+            }
+            ::SetConsoleTextAttribute(m_handle, attr);
+            DWORD wrote = 0;
+            ::WriteConsoleW(m_handle, m_buf.c_str(), static_cast<DWORD>(m_buf.length()), &wrote, NULL);
+            if (wrote == m_buf.length()) total += bytes;
+        }
+        return total;
+    }
+
     void set_context_attr(int context_id, WORD attr)
     {
         m_ca[context_id] = attr;
     }
 
 protected:
+    WORD get_attr(int context_id) const
+    {
+        std::map<int, WORD>::const_iterator it = m_ca.find(context_id);
+        return it == m_ca.end() ? m_default_attr : it->second;
+    }
+
     HANDLE m_handle;
     std::map<int, WORD> m_ca;
+    std::wstring m_buf;
     WORD m_default_attr;
     bool m_free_console_on_close;
     bool padding[1];
@@ -82,6 +125,165 @@ private:
     }
 };
 
+/** console device that colors with ANSI escape sequences instead of console attributes:
+* a batch of lines is built in memory with the escapes inline and goes out in one call,
+* where ld_console switches the attribute and writes once per color. the colors are
+* console attributes as for ld_console::set_context_attr. on a console that does not
+* take escape sequences (before Windows 10) and when the output is redirected to a file
+* or a pipe, the text is written without colors
+*/
+class ld_terminal : public log_device
+{
+public:
+    //! \a out defaults to the standard output
+    explicit ld_terminal(HANDLE out = NULL, bool color = true)
+        : m_handle(out)
+        , m_own_handle(out == NULL)
+        , m_color(color)
+        , m_console(false)
+        , m_escapes(false)
+        , m_mode_changed(false)
+        , m_old_mode(0)
+    {
+    }
+
+    virtual bool open()
+    {
+        if (m_own_handle) m_handle = ::GetStdHandle(STD_OUTPUT_HANDLE);
+        if (m_handle == NULL || m_handle == INVALID_HANDLE_VALUE) return false;
+
+        DWORD mode = 0;
+        m_console = (::GetConsoleMode(m_handle, &mode) == TRUE);
+        m_escapes = false;
+        if (m_console && m_color)
+        {
+            m_old_mode = mode;
+            m_escapes = (mode & ENABLE_VIRTUAL_TERMINAL_PROCESSING) != 0;
+            if (!m_escapes && ::SetConsoleMode(m_handle, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING))
+            {
+                m_escapes = true;
+                m_mode_changed = true;
+            }
+        }
+        return true;
+    }
+
+    virtual bool close()
+    {
+        if (m_mode_changed)
+        {
+            ::SetConsoleMode(m_handle, m_old_mode);
+            m_mode_changed = false;
+        }
+        return true;
+    }
+
+    virtual bool flush()
+    {
+        return true;
+    }
+
+    using log_device::write;
+
+    virtual size_t write(const char * buf, size_t len, int context_id)
+    {
+        log_segment seg = { buf, len, context_id };
+        return writev(&seg, 1);
+    }
+
+    virtual size_t writev(const log_segment * segs, size_t count)
+    {
+        m_buf.clear();
+        const std::string * current = NULL;
+        size_t text_len = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            if (m_escapes)
+            {
+                const std::string * sgr = get_sgr(segs[i].context_id);
+                if (sgr != current)
+                {
+                    m_buf += sgr ? *sgr : reset();
+                    current = sgr;
+                }
+            }
+            m_buf.append(segs[i].buf, segs[i].len);
+            text_len += segs[i].len;
+        }
+        if (current) m_buf += reset();
+        return put(m_buf) ? text_len : 0;
+    }
+
+    // without colors, a console gets the line through a stack buffer
+    virtual bool crash_write(const char * text, size_t len)
+    {
+        if (m_handle == NULL || m_handle == INVALID_HANDLE_VALUE) return false;
+        DWORD wrote = 0;
+        if (!m_console) return ::WriteFile(m_handle, text, static_cast<DWORD>(len), &wrote, NULL) == TRUE;
+        wchar_t wide[2048];
+        int n = ::MultiByteToWideChar(CP_UTF8, 0, text, static_cast<int>(len), wide, sizeof(wide)/sizeof(wide[0]));
+        return n > 0 && ::WriteConsoleW(m_handle, wide, static_cast<DWORD>(n), &wrote, NULL) == TRUE;
+    }
+
+    /** same attributes as ld_console::set_context_attr: FOREGROUND_* and BACKGROUND_* bits,
+    * call it before the device is added
+    */
+    void set_context_attr(int context_id, WORD attr)
+    {
+        // console attributes are BGR, ANSI colors RGB
+        static const int rgb[8] = { 0, 4, 2, 6, 1, 5, 3, 7 };
+        int fg = rgb[attr & 7];
+        int bg = rgb[(attr >> 4) & 7];
+        std::string sgr = "\x1b[";
+        sgr += static_cast<const char *>(czA("%d", (attr & FOREGROUND_INTENSITY) ? 90 + fg : 30 + fg));
+        if (attr & 0x70)
+        {
+            sgr += static_cast<const char *>(czA(";%d", (attr & BACKGROUND_INTENSITY) ? 100 + bg : 40 + bg));
+        }
+        sgr += "m";
+        m_sgr[context_id] = sgr;
+    }
+
+protected:
+    const std::string * get_sgr(int context_id) const
+    {
+        std::map<int, std::string>::const_iterator it = m_sgr.find(context_id);
+        return it == m_sgr.end() ? NULL : &it->second;
+    }
+
+    static const std::string& reset()
+    {
+        static const std::string s_reset("\x1b[0m");
+        return s_reset;
+    }
+
+    // a console takes UTF-16, files and pipes get the UTF-8 as it is
+    bool put(const std::string& text)
+    {
+        if (text.empty()) return true;
+        DWORD wrote = 0;
+        if (m_console)
+        {
+            m_wbuf.clear();
+            log_utf8::append(m_wbuf, text.c_str(), text.length());
+            return ::WriteConsoleW(m_handle, m_wbuf.c_str(), static_cast<DWORD>(m_wbuf.length()), &wrote, NULL) == TRUE;
+        }
+        return ::WriteFile(m_handle, text.c_str(), static_cast<DWORD>(text.length()), &wrote, NULL) == TRUE;
+    }
+
+    HANDLE m_handle;
+    std::map<int, std::string> m_sgr;
+    std::string m_buf;
+    std::wstring m_wbuf;
+    bool m_own_handle;
+    bool m_color;
+    bool m_console;
+    bool m_escapes;
+    bool m_mode_changed;
+    bool padding[3];
+    DWORD m_old_mode;
+};
+
 class ld_mem_log : public log_device
 {
 public:
@@ -92,23 +294,307 @@ public:
 
     virtual bool open() { return true; }
     virtual bool close() { return true; }
-    virtual size_t write(const wchar_t * buf, size_t len, int)
+    using log_device::write;
+    virtual size_t write(const char * buf, size_t len, int)
     {
-        m_log += std::wstring(buf, len);
+        m_log.append(buf, len);
         return len;
     }
+    virtual size_t writev(const log_segment * segs, size_t count)
+    {
+        size_t n = 0;
+        for (size_t i = 0; i < count; i++) n += segs[i].len;
+        m_log.reserve(m_log.length() + n);
+        for (size_t i = 0; i < count; i++) m_log.append(segs[i].buf, segs[i].len);
+        return n;
+    }
     virtual bool flush()
     {
         return true;
     }
 
     void get_log(std::wstring& str)
+    {
+        str.clear();
+        log_utf8::append(str, m_log.c_str(), m_log.length());
+    }
+
+    //! the log as UTF-8
+    void get_log(std::string& str)
     {
         str = m_log;
     }
 
 private:
-    std::wstring m_log;
+    std::string m_log;
+};
+
+/** fixed size, always-on in-memory log: keeps the last lines of each thread, the oldest
+* lines are overwritten. every writing thread gets its own ring of fixed size slots, writing
+* a line is one uncontended atomic increment and a memcpy, no lock and no allocation.
+* lines longer than the slot are truncated.
+* besides acting as a device, record() can be called directly from any thread.
+* dump()/dump_to_file() allocate nothing and take no lock, they can be used from a crash handler
+*/
+class ld_flight_recorder : public log_device
+{
+public:
+    enum { max_rings = 64 };
+
+    /** \param slots lines kept per thread, rounded up to a power of 2
+    *   \param slot_size bytes per line including a 16 byte header
+    *   \param rings threads with their own ring, later threads share them
+    */
+    ld_flight_recorder(size_t slots = 4096, size_t slot_size = 256, size_t rings = 16)
+        : m_slot_size(slot_size < 64 ? 64 : (slot_size + 7) / 8 * 8)
+        , m_ring_count(rings < 1 ? 1 : (rings > max_rings ? max_rings : rings))
+        , m_rings_used(0)
+    {
+        size_t n = 2;
+        while (n < slots) n *= 2;
+        m_slots = n;
+        for (size_t i = 0; i < max_rings; i++)
+        {
+            m_rings[i].head = 0;
+            m_rings[i].data = NULL;
+        }
+    }
+
+    virtual ~ld_flight_recorder()
+    {
+        for (size_t i = 0; i < max_rings; i++)
+        {
+            delete [] m_rings[i].data;
+        }
+    }
+
+    virtual bool open() { return true; }
+    virtual bool close() { return true; }
+    virtual bool flush() { return true; }
+
+    using log_device::write;
+    virtual size_t write(const char * buf, size_t len, int)
+    {
+        record(buf, len);
+        return len;
+    }
+
+    // one slot per line
+    virtual size_t writev(const log_segment * segs, size_t count)
+    {
+        size_t total = 0;
+        slot_header * slot = NULL;
+        for (size_t i = 0; i < count; i++)
+        {
+            if (!slot) slot = begin_slot();
+            append(slot, segs[i].buf, segs[i].len);
+            total += segs[i].len;
+            if (segs[i].len > 0 && segs[i].buf[segs[i].len - 1] == '\n')
+            {
+                end_slot(slot);
+                slot = NULL;
+            }
+        }
+        if (slot) end_slot(slot);
+        return total;
+    }
+
+    //! records one line (UTF-8) into the calling thread's ring
+    void record(const char * text, size_t len)
+    {
+        slot_header * slot = begin_slot();
+        append(slot, text, len);
+        end_slot(slot);
+    }
+
+    //! all recorded lines of all threads in time order, as UTF-8
+    void snapshot(std::string& out) const
+    {
+        out.clear();
+        string_sink sink(out);
+        walk(sink);
+    }
+
+    //! writes the lines to an open file, safe to call from a crash handler
+    bool dump(HANDLE file) const
+    {
+        file_sink sink(file);
+        walk(sink);
+        return sink.ok;
+    }
+
+    bool dump_to_file(const wchar_t * path) const
+    {
+        HANDLE file = ::CreateFileW(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        bool ok = dump(file);
+        ::CloseHandle(file);
+        return ok;
+    }
+
+    //! has crash_flush() (see log_crash.h) dump the recorder to \a path
+    void dump_on_crash(const wchar_t * path)
+    {
+        m_crash_path = path ? path : L"";
+    }
+
+    // a thread that never logged has no ring, taking one would allocate it
+    virtual bool crash_write(const char * text, size_t len)
+    {
+        if (!m_tls.get()) return false;
+        record(text, len);
+        return true;
+    }
+
+    virtual bool crash_flush()
+    {
+        return !m_crash_path.empty() && dump_to_file(m_crash_path.c_str());
+    }
+
+private:
+    struct slot_header
+    {
+        volatile LONG seq;      // odd while the slot is being written
+        unsigned int len;
+        LONGLONG stamp;
+    };
+
+    struct ring
+    {
+        volatile LONGLONG head;
+        char * data;
+        char padding[48];
+    };
+
+    slot_header * begin_slot()
+    {
+        ring& r = current_ring();
+        slot_header * slot;
+        for (;;)
+        {
+            LONGLONG n = ::InterlockedIncrement64(&r.head) - 1;
+            slot = reinterpret_cast<slot_header *>(r.data + static_cast<size_t>(n & (m_slots - 1)) * m_slot_size);
+            // a writer of a shared ring may still be in the slot a whole ring later, take the next one
+            LONG seq = slot->seq;
+            if (!(seq & 1) && ::InterlockedCompareExchange(&slot->seq, seq + 1, seq) == seq) break;
+        }
+        LARGE_INTEGER now;
+        ::QueryPerformanceCounter(&now);
+        slot->stamp = now.QuadPart;
+        slot->len = 0;
+        return slot;
+    }
+
+    void append(slot_header * slot, const char * buf, size_t len) const
+    {
+        size_t room = m_slot_size - sizeof(slot_header) - slot->len;
+        if (len > room) len = room;
+        memcpy(reinterpret_cast<char *>(slot + 1) + slot->len, buf, len);
+        slot->len += static_cast<unsigned int>(len);
+    }
+
+    void end_slot(slot_header * slot)
+    {
+        ::InterlockedIncrement(&slot->seq);
+    }
+
+    ring& current_ring()
+    {
+        size_t index = reinterpret_cast<size_t>(m_tls.get());
+        if (index == 0)
+        {
+            // first line of this thread: take the next ring, wrap around when all are taken
+            index = static_cast<size_t>(::InterlockedIncrement(&m_rings_used) - 1) % m_ring_count + 1;
+            m_tls.set(reinterpret_cast<void *>(index));
+            ring& r = m_rings[index - 1];
+            if (!r.data)
+            {
+                char * data = new char[m_slots * m_slot_size];
+                memset(data, 0, m_slots * m_slot_size);
+                if (::InterlockedCompareExchangePointer(reinterpret_cast<void * volatile *>(&r.data), data, NULL) != NULL)
+                {
+                    delete [] data;
+                }
+            }
+        }
+        return m_rings[index - 1];
+    }
+
+    struct string_sink
+    {
+        explicit string_sink(std::string& s) : out(s) {}
+        void put(const char * buf, size_t len) { out.append(buf, len); }
+        std::string& out;
+    private:
+        string_sink& operator=(const string_sink&);
+    };
+
+    struct file_sink
+    {
+        explicit file_sink(HANDLE h) : file(h), ok(true) {}
+        void put(const char * buf, size_t len)
+        {
+            DWORD written = 0;
+            if (!::WriteFile(file, buf, static_cast<DWORD>(len), &written, NULL)) ok = false;
+        }
+        HANDLE file;
+        bool ok;
+    };
+
+    //! merges the rings by time stamp, uses only the stack
+    template <typename Sink>
+    void walk(Sink& sink) const
+    {
+        LONGLONG next[max_rings];
+        LONGLONG end[max_rings];
+        for (size_t i = 0; i < m_ring_count; i++)
+        {
+            end[i] = m_rings[i].data ? m_rings[i].head : 0;
+            next[i] = end[i] > static_cast<LONGLONG>(m_slots) ? end[i] - static_cast<LONGLONG>(m_slots) : 0;
+        }
+
+        char line[1024];
+        for (;;)
+        {
+            size_t best = max_rings;
+            LONGLONG best_stamp = 0;
+            for (size_t i = 0; i < m_ring_count; i++)
+            {
+                if (next[i] >= end[i]) continue;
+                const slot_header * slot = slot_at(i, next[i]);
+                if (best == max_rings || slot->stamp < best_stamp)
+                {
+                    best = i;
+                    best_stamp = slot->stamp;
+                }
+            }
+            if (best == max_rings) break;
+
+            // copy first, then check that no writer touched the slot meanwhile
+            const slot_header * slot = slot_at(best, next[best]++);
+            LONG seq = slot->seq;
+            size_t len = slot->len;
+            if (len > sizeof(line) - 1) len = sizeof(line) - 1;
+            if (len > m_slot_size - sizeof(slot_header)) len = m_slot_size - sizeof(slot_header);
+            memcpy(line, slot + 1, len);
+            if ((seq & 1) || seq != slot->seq || len == 0) continue;
+            if (line[len - 1] != '\n') line[len++] = '\n';
+            sink.put(line, len);
+        }
+    }
+
+    const slot_header * slot_at(size_t ring_index, LONGLONG n) const
+    {
+        return reinterpret_cast<const slot_header *>(m_rings[ring_index].data + static_cast<size_t>(n & (m_slots - 1)) * m_slot_size);
+    }
+
+    size_t m_slots;
+    size_t m_slot_size;
+    size_t m_ring_count;
+    volatile LONG m_rings_used;
+    std::wstring m_crash_path;
+    os::tls_value m_tls;
+    ring m_rings[max_rings];
 };
 
 class ld_debug_output : public log_device
@@ -135,29 +621,61 @@ public:
         return len;
     }
 
+    virtual size_t write(const char * buf, size_t len, int)
+    {
+        m_buf.clear();
+        log_utf8::append(m_buf, buf, len);
+        ::OutputDebugStringW(m_buf.c_str());
+        return len;
+    }
+
+    // returns UTF-8 bytes like every writev, not the UTF-16 length that went out
+    virtual size_t writev(const log_segment * segs, size_t count)
+    {
+        size_t bytes = 0;
+        m_buf.clear();
+        for (size_t i = 0; i < count; i++)
+        {
+            log_utf8::append(m_buf, segs[i].buf, segs[i].len);
+            bytes += segs[i].len;
+        }
+        ::OutputDebugStringW(m_buf.c_str());
+        return bytes;
+    }
+
     virtual bool flush()
     {
         return true;
     }
+
+private:
+    std::wstring m_buf;
 };
 
 class ld_file : public log_device
 {
 public:
-    ld_file(const wchar_t * filename)
+    //! \a append keeps the content of an existing file instead of truncating it
+    ld_file(const wchar_t * filename, bool append = false)
     {
         m_filename = filename;
         m_fp = NULL;
+        m_append = append;
+        m_index_fp = NULL;
+        m_index_every = 0;
+        m_index_pending = 0;
     }
     
     virtual bool open()
     {
-        m_fp = _wfsopen(m_filename.c_str(), L"wt", _SH_DENYWR);
+        m_fp = _wfsopen(m_filename.c_str(), m_append ? L"at" : L"wt", _SH_DENYWR);
+        if (m_fp && m_index_every > 0) open_index();
         return (m_fp != NULL);
     }
 
     virtual bool close()
     {
+        close_index();
         if (m_fp)
         {
             fclose(m_fp);
@@ -167,21 +685,1656 @@ public:
         return false;
     }
 
-    virtual size_t write(const wchar_t *buf, size_t len, int)
+    /** keeps a sparse time index in "<filename>.idx": an entry every \a every_bytes of log,
+    * see log_index. call it before the device is added
+    */
+    void enable_index(size_t every_bytes = 64 * 1024)
+    {
+        m_index_every = every_bytes > 0 ? every_bytes : 1;
+    }
+
+    using log_device::write;
+
+    //! the file is UTF-8, wide text is converted by log_device::write
+    virtual size_t write(const char * buf, size_t len, int)
     {
-        if (m_fp) return static_cast<size_t>(fwprintf(m_fp, L"%.*s", len, buf));
+        if (m_fp) return fwrite(buf, 1, len, m_fp);
         return 0;
     }
 
+    // the whole batch goes to the stream with one call
+    virtual size_t writev(const log_segment * segs, size_t count)
+    {
+        if (!m_fp) return 0;
+        m_buf.clear();
+        for (size_t i = 0; i < count; i++) m_buf.append(segs[i].buf, segs[i].len);
+
+        // a batch starts with a line, so that is where an index entry may point
+        if (m_index_fp)
+        {
+            if (m_index_pending >= m_index_every)
+            {
+                log_index_entry e;
+                e.time = log_index::now();
+                e.offset = static_cast<unsigned __int64>(_ftelli64(m_fp));
+                fwrite(&e, sizeof(e), 1, m_index_fp);
+                m_index_pending = 0;
+            }
+            m_index_pending += m_buf.length();
+        }
+        return ld_file::write(m_buf.c_str(), m_buf.length(), 0);
+    }
+
     virtual bool flush()
     {
+        if (m_index_fp) fflush(m_index_fp);
         return fflush(m_fp) == 0;
     }
 
+    //! flushes the stream and the system cache to the disk
+    virtual bool sync()
+    {
+        if (m_index_fp) fflush(m_index_fp);
+        if (!m_fp || fflush(m_fp) != 0) return false;
+        return ::FlushFileBuffers(reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(m_fp)))) != FALSE;
+    }
+
+    // the stream lock may be held by the crashing thread
+    virtual bool crash_write(const char * text, size_t len)
+    {
+        return m_fp && _fwrite_nolock(text, 1, len, m_fp) == len;
+    }
+
+    virtual bool crash_flush()
+    {
+        if (m_index_fp) _fflush_nolock(m_index_fp);
+        return m_fp && _fflush_nolock(m_fp) == 0;
+    }
+
 protected:
+    bool open_index()
+    {
+        m_index_fp = _wfsopen(log_index_name(m_filename).c_str(), m_append ? L"ab" : L"wb", _SH_DENYWR);
+        // the first batch after opening always gets an entry
+        m_index_pending = m_index_every;
+        return m_index_fp != NULL;
+    }
+
+    void close_index()
+    {
+        if (m_index_fp)
+        {
+            fclose(m_index_fp);
+            m_index_fp = NULL;
+        }
+    }
+
     FILE * m_fp;
     std::wstring m_filename;
+    std::string m_buf;
+    bool m_append;
+    bool padding[3];
+    FILE * m_index_fp;
+    size_t m_index_every;
+    size_t m_index_pending;
+};
+
+/** stores the structured records of tp::log_kv in the binary format described in log_kv.h,
+* plain text lines are ignored. read the file with log_kv_reader or log_kv_convert
+*/
+class ld_kv_file : public ld_file
+{
+public:
+    ld_kv_file(const wchar_t * filename, bool append = true) : ld_file(filename, append)
+    {
+    }
+
+    virtual bool open()
+    {
+        m_fp = _wfsopen(m_filename.c_str(), m_append ? L"ab" : L"wb", _SH_DENYWR);
+        if (!m_fp) return false;
+        _fseeki64(m_fp, 0, SEEK_END);
+        if (_ftelli64(m_fp) == 0)
+        {
+            fwrite(log_kv_file_header::magic(), 1, log_kv_file_header::size, m_fp);
+        }
+        return true;
+    }
+
+    using ld_file::write;
+    virtual size_t write(const char *, size_t, int)
+    {
+        return 0;
+    }
+
+    virtual size_t writev(const log_segment *, size_t)
+    {
+        return 0;
+    }
+
+    virtual bool crash_write(const char *, size_t)
+    {
+        return false;
+    }
+
+    virtual bool write_record(const char * record, size_t len)
+    {
+        if (m_fp) fwrite(record, 1, len, m_fp);
+        return true;
+    }
 };
+
+/** ld_file that starts a new file when the current one gets too big or too old.
+* app.log is renamed to app.log.20261017-103200 and reopened empty; the rotated file is
+* compressed and old ones are deleted on a background thread, so rotating only costs a rename.
+* compression is NTFS compression (files stay readable as they are), override compress()
+* to use something else
+*/
+class ld_rotating_file : public ld_file
+{
+public:
+    /** \param max_size rotate when the file reaches about this many bytes, 0 for no limit
+    *   \param interval rotate every \a interval seconds (aligned to local midnight), 0 for never
+    *   \param keep number of rotated files to keep, 0 for all
+    */
+    ld_rotating_file(const wchar_t * filename, unsigned __int64 max_size = 64 * 1024 * 1024,
+        unsigned int interval = 0, unsigned int keep = 10, bool compress_rotated = true)
+        : ld_file(filename, true)
+        , m_max_size(max_size)
+        , m_interval(interval)
+        , m_keep(keep)
+        , m_compress(compress_rotated)
+        , m_size(0)
+        , m_next_rotate(0)
+        , m_retry_rotate(0)
+        , m_worker(NULL)
+        , m_wakeup(NULL)
+        , m_stop(0)
+    {
+    }
+
+    virtual ~ld_rotating_file()
+    {
+        stop_worker();
+    }
+
+    virtual bool open()
+    {
+        if (!ld_file::open()) return false;
+        _fseeki64(m_fp, 0, SEEK_END);
+        __int64 size = _ftelli64(m_fp);
+        m_size = size > 0 ? static_cast<unsigned __int64>(size) : 0;
+        m_next_rotate = next_rotate_time(time(NULL));
+        return true;
+    }
+
+    virtual bool close()
+    {
+        bool ret = ld_file::close();
+        stop_worker();
+        return ret;
+    }
+
+    using ld_file::write;
+
+    virtual size_t write(const char * buf, size_t len, int context_id)
+    {
+        autolocker<critical_section_lock> locker(m_file_lock);
+        check_rotate();
+        size_t n = ld_file::write(buf, len, context_id);
+        update_size();
+        return n;
+    }
+
+    // rotation is only checked between batches, so a line never spans two files
+    virtual size_t writev(const log_segment * segs, size_t count)
+    {
+        autolocker<critical_section_lock> locker(m_file_lock);
+        check_rotate();
+        size_t n = ld_file::writev(segs, count);
+        update_size();
+        return n;
+    }
+
+    virtual bool flush()
+    {
+        autolocker<critical_section_lock> locker(m_file_lock);
+        return m_fp && ld_file::flush();
+    }
+
+    virtual bool sync()
+    {
+        autolocker<critical_section_lock> locker(m_file_lock);
+        return ld_file::sync();
+    }
+
+    // a rotation may have the file closed or half renamed, the line is skipped then
+    virtual bool crash_write(const char * text, size_t len)
+    {
+        if (m_file_lock.held_by_caller() || !m_file_lock.try_lock()) return false;
+        bool ok = ld_file::crash_write(text, len);
+        m_file_lock.unlock();
+        return ok;
+    }
+
+    /** forces a rotation now. it may be called from any thread, e.g. from a console control
+    * handler that asks for a new file, writes wait until the new file is open
+    */
+    virtual bool rotate()
+    {
+        autolocker<critical_section_lock> locker(m_file_lock);
+        close_index();
+        if (m_fp)
+        {
+            fclose(m_fp);
+            m_fp = NULL;
+        }
+
+        std::wstring rotated = rotated_name(time(NULL));
+        bool renamed = (::MoveFileExW(m_filename.c_str(), rotated.c_str(), 0) == TRUE);
+        if (renamed && m_index_every > 0)
+        {
+            ::MoveFileExW(log_index_name(m_filename).c_str(), log_index_name(rotated).c_str(), MOVEFILE_REPLACE_EXISTING);
+        }
+        bool opened = open();
+        if (renamed)
+        {
+            m_retry_rotate = 0;
+            post_rotated(rotated);
+        }
+        else
+        {
+            // the file may be held open by a reader, keep writing to it and try again later
+            m_retry_rotate = time(NULL) + retry_delay;
+        }
+        return renamed && opened;
+    }
+
+protected:
+    //! compresses a rotated file, runs on the background thread
+    virtual bool compress(const std::wstring& path)
+    {
+        HANDLE h = ::CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (h == INVALID_HANDLE_VALUE) return false;
+        USHORT format = COMPRESSION_FORMAT_DEFAULT;
+        DWORD ret = 0;
+        BOOL ok = ::DeviceIoControl(h, FSCTL_SET_COMPRESSION, &format, sizeof(format), NULL, 0, &ret, NULL);
+        ::CloseHandle(h);
+        return ok == TRUE;
+    }
+
+    //! rotated files sorted from old to new, other files next to the log (another device's) are left out
+    std::vector<std::wstring> rotated_files() const
+    {
+        std::vector<std::wstring> files;
+        size_t dir_len = m_filename.find_last_of(L"\\/");
+        std::wstring dir = (dir_len == std::wstring::npos) ? L"" : m_filename.substr(0, dir_len + 1);
+        size_t base_len = m_filename.length() - dir.length();
+
+        WIN32_FIND_DATAW fd;
+        HANDLE h = ::FindFirstFileW((m_filename + L".*").c_str(), &fd);
+        if (h != INVALID_HANDLE_VALUE)
+        {
+            do
+            {
+                // the index of a rotated file goes with it, see process_pending
+                if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && wcslen(fd.cFileName) > base_len
+                    && is_rotated_suffix(fd.cFileName + base_len)) files.push_back(dir + fd.cFileName);
+            } while (::FindNextFileW(h, &fd));
+            ::FindClose(h);
+        }
+        std::sort(files.begin(), files.end(), &ld_rotating_file::rotated_before);
+        return files;
+    }
+
+    //! ".YYYYMMDD-HHMMSS" with an optional "-N", what rotated_name() appends
+    static bool is_rotated_suffix(const wchar_t * s)
+    {
+        static const wchar_t stamp[] = L".########-######";
+        for (size_t i = 0; stamp[i]; i++)
+        {
+            if (stamp[i] == L'#' ? !(s[i] >= L'0' && s[i] <= L'9') : s[i] != stamp[i]) return false;
+        }
+        s += sizeof(stamp)/sizeof(stamp[0]) - 1;
+        if (*s == 0) return true;
+        if (*s++ != L'-' || *s == 0) return false;
+        while (*s >= L'0' && *s <= L'9') s++;
+        return *s == 0;
+    }
+
+    // by time stamp, then by counter: "-10" is newer than "-9"
+    static bool rotated_before(const std::wstring& a, const std::wstring& b)
+    {
+        size_t end = a.find_last_of(L'.') + 16;
+        int c = a.compare(0, end, b, 0, end);
+        if (c != 0) return c < 0;
+        return a.length() != b.length() ? a.length() < b.length() : a < b;
+    }
+
+    enum { retry_delay = 60 };  // seconds between attempts after a failed rename
+
+    bool rotate_due() const
+    {
+        if (m_retry_rotate != 0 && time(NULL) < m_retry_rotate) return false;
+        return (m_max_size > 0 && m_size >= m_max_size) || (m_interval > 0 && time(NULL) >= m_next_rotate);
+    }
+
+    //! the stream turns "\n" into "\r\n", so the size on disk comes from the stream, not from the text
+    void update_size()
+    {
+        if (!m_fp) return;
+        __int64 size = _ftelli64(m_fp);
+        if (size > 0) m_size = static_cast<unsigned __int64>(size);
+    }
+
+    void check_rotate()
+    {
+        if (rotate_due())
+        {
+            rotate();
+        }
+    }
+
+    time_t next_rotate_time(time_t now) const
+    {
+        if (m_interval == 0) return 0;
+        struct tm local;
+        localtime_s(&local, &now);
+        time_t local_now = _mkgmtime(&local);
+        return now - (local_now % m_interval) + m_interval;
+    }
+
+    std::wstring rotated_name(time_t now) const
+    {
+        struct tm local;
+        localtime_s(&local, &now);
+        wchar_t stamp[32];
+        wcsftime(stamp, sizeof(stamp)/sizeof(stamp[0]), L".%Y%m%d-%H%M%S", &local);
+
+        // two rotations in the same second get a counter
+        std::wstring name = m_filename + stamp;
+        for (int i = 1; ::GetFileAttributesW(name.c_str()) != INVALID_FILE_ATTRIBUTES; i++)
+        {
+            name = m_filename + stamp + static_cast<const wchar_t *>(cz(L"-%d", i));
+        }
+        return name;
+    }
+
+    void post_rotated(const std::wstring& path)
+    {
+        if (!m_worker)
+        {
+            m_stop = 0;
+            m_wakeup = ::CreateEventW(NULL, FALSE, FALSE, NULL);
+            m_worker = reinterpret_cast<HANDLE>(::_beginthreadex(NULL, 0, &ld_rotating_file::worker_proc, this, 0, NULL));
+        }
+
+        {
+            autolocker<critical_section_lock> locker(m_lock);
+            m_pending.push_back(path);
+        }
+
+        if (m_worker)
+        {
+            ::SetEvent(m_wakeup);
+        }
+        else
+        {
+            // no thread, do it here rather than never
+            process_pending();
+        }
+    }
+
+    void stop_worker()
+    {
+        if (m_worker)
+        {
+            ::InterlockedExchange(&m_stop, 1);
+            ::SetEvent(m_wakeup);
+            ::WaitForSingleObject(m_worker, INFINITE);
+            ::CloseHandle(m_worker);
+            m_worker = NULL;
+        }
+        if (m_wakeup)
+        {
+            ::CloseHandle(m_wakeup);
+            m_wakeup = NULL;
+        }
+    }
+
+    void process_pending()
+    {
+        for (;;)
+        {
+            std::wstring path;
+            {
+                autolocker<critical_section_lock> locker(m_lock);
+                if (m_pending.empty()) break;
+                path = m_pending.front();
+                m_pending.pop_front();
+            }
+            if (m_compress) compress(path);
+        }
+
+        if (m_keep > 0)
+        {
+            std::vector<std::wstring> files = rotated_files();
+            for (size_t i = 0; i + m_keep < files.size(); i++)
+            {
+                ::DeleteFileW(files[i].c_str());
+                ::DeleteFileW(log_index_name(files[i]).c_str());
+            }
+        }
+    }
+
+    static unsigned int __stdcall worker_proc(void * param)
+    {
+        ld_rotating_file * self = static_cast<ld_rotating_file *>(param);
+        // stop_worker sets the event too, so files posted before it are still processed
+        for (;;)
+        {
+            ::WaitForSingleObject(self->m_wakeup, INFINITE);
+            self->process_pending();
+            if (self->m_stop) break;
+        }
+        return 0;
+    }
+
+    unsigned __int64 m_max_size;
+    unsigned int m_interval;
+    unsigned int m_keep;
+    bool m_compress;
+    unsigned __int64 m_size;
+    time_t m_next_rotate;
+    time_t m_retry_rotate;              // no rotation before this after a failed rename, 0 for none
+    critical_section_lock m_file_lock;  // m_fp and the size between writes and rotate
+
+    HANDLE m_worker;
+    HANDLE m_wakeup;
+    volatile LONG m_stop;
+    critical_section_lock m_lock;
+    std::list<std::wstring> m_pending;
+};
+
+/** ld_rotating_file that compresses its output as it goes. lines collect in a block of about
+* \a block_size bytes, full blocks are compressed and written by a background thread (see
+* log_lz.h for the format). every block is compressed on its own and gets an entry in the block
+* index "<filename>.idx", so a reader can start at any block. \a max_size is the size of the
+* file, it counts compressed bytes as they are written. a partly filled block is written on
+* sync(), rotation and close(), and by flush() once it is \a max_delay_ms old, so flushing
+* after every line does not cut the blocks short
+* @code
+*   tp::log_add_device(new tp::ld_compressed_file(L"app.log.lz", 1024 * 1024 * 1024), 0xFF);
+* @endcode
+*/
+class ld_compressed_file : public ld_rotating_file
+{
+public:
+    ld_compressed_file(const wchar_t * filename, unsigned __int64 max_size = 0, unsigned int interval = 0,
+        unsigned int keep = 10, size_t block_size = 256 * 1024, unsigned int max_delay_ms = 1000)
+        : ld_rotating_file(filename, max_size, interval, keep, false)
+        , m_block_size(block_size < 4096 ? 4096 : (block_size > max_block_size ? max_block_size : block_size))
+        , m_max_delay(max_delay_ms)
+        , m_block(NULL)
+        , m_block_tick(0)
+        , m_compressor(NULL)
+        , m_compressor_tid(0)
+        , m_work(NULL)
+        , m_done(NULL)
+        , m_stop_compressor(0)
+        , m_in_flight(0)
+    {
+        // the index goes with the file on rotation and retention
+        m_index_every = 1;
+    }
+
+    virtual ~ld_compressed_file()
+    {
+        close();
+        delete m_block;
+        for (std::list<block *>::iterator it = m_free.begin(); it != m_free.end(); ++it) delete *it;
+    }
+
+    virtual bool open()
+    {
+        m_fp = _wfsopen(m_filename.c_str(), m_append ? L"ab" : L"wb", _SH_DENYWR);
+        if (!m_fp) return false;
+        _fseeki64(m_fp, 0, SEEK_END);
+        __int64 size = _ftelli64(m_fp);
+        if (size <= 0)
+        {
+            fwrite(log_lz_file_header::magic(), 1, log_lz_file_header::size, m_fp);
+        }
+        m_size = size > 0 ? static_cast<unsigned __int64>(size) : 0;
+        m_next_rotate = next_rotate_time(time(NULL));
+        open_index();
+        start_compressor();
+        return true;
+    }
+
+    virtual bool close()
+    {
+        if (m_fp)
+        {
+            submit_block();
+            wait_idle();
+        }
+        stop_compressor();
+        return ld_rotating_file::close();
+    }
+
+    using ld_rotating_file::write;
+
+    virtual size_t write(const char * buf, size_t len, int)
+    {
+        autolocker<critical_section_lock> locker(m_file_lock);
+        if (!begin_write()) return 0;
+        append_block(buf, len);
+        return end_write(len);
+    }
+
+    virtual size_t writev(const log_segment * segs, size_t count)
+    {
+        autolocker<critical_section_lock> locker(m_file_lock);
+        if (!begin_write()) return 0;
+        size_t n = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            append_block(segs[i].buf, segs[i].len);
+            n += segs[i].len;
+        }
+        return end_write(n);
+    }
+
+    // the compressor writes and flushes whole blocks, only a block that waited too long is cut here
+    virtual bool flush()
+    {
+        autolocker<critical_section_lock> locker(m_file_lock);
+        if (m_block && ::GetTickCount() - m_block_tick >= m_max_delay) submit_block();
+        return m_fp != NULL;
+    }
+
+    virtual bool sync()
+    {
+        autolocker<critical_section_lock> locker(m_file_lock);
+        submit_block();
+        wait_idle();
+        return ld_rotating_file::sync();
+    }
+
+    virtual bool rotate()
+    {
+        autolocker<critical_section_lock> locker(m_file_lock);
+        submit_block();
+        wait_idle();
+        return ld_rotating_file::rotate();
+    }
+
+    // the current block goes first, the line is a stored block of its own after it
+    virtual bool crash_write(const char * text, size_t len)
+    {
+        if (!crash_lock()) return false;
+        crash_store_block();
+        crash_store(text, len, log_index::now());
+        m_file_lock.unlock();
+        return true;
+    }
+
+    /** gives the compressor up to a second for the blocks it has, then appends the current
+    * block uncompressed: compressing needs memory the crash may have broken. the block is
+    * left out while another thread holds it or the crashing thread was in the middle of a write
+    */
+    virtual bool crash_flush()
+    {
+        if (!m_fp) return false;
+        if (crash_lock())
+        {
+            crash_store_block();
+            m_file_lock.unlock();
+        }
+        return ld_file::crash_flush();
+    }
+
+protected:
+    enum { max_in_flight = 4 };
+    enum { max_block_size = log_lz_block_header::max_raw_size / 2 };
+
+    struct block
+    {
+        std::string text;
+        unsigned __int64 time;  // of the first line
+    };
+
+    //! on the crashing thread: true with m_file_lock taken once the compressor has written its blocks
+    bool crash_lock()
+    {
+        if (!m_fp) return false;
+        if (m_compressor && ::GetCurrentThreadId() != m_compressor_tid)
+        {
+            for (int i = 0; i < 1000 && m_in_flight > 0; i++) ::Sleep(1);
+        }
+        if (m_file_lock.held_by_caller() || !m_file_lock.try_lock()) return false;
+        // blocks are only submitted under the lock, so none can start after this check
+        if (m_in_flight > 0)
+        {
+            m_file_lock.unlock();
+            return false;
+        }
+        return true;
+    }
+
+    void crash_store_block()
+    {
+        if (!m_block || m_block->text.empty()) return;
+        crash_store(m_block->text.c_str(), m_block->text.length(), m_block->time);
+        m_block->text.clear();
+    }
+
+    //! appends a stored block and its index entry with the stream locks the crash may hold
+    void crash_store(const char * data, size_t len, unsigned __int64 time)
+    {
+        log_index_entry e;
+        e.time = time;
+        e.offset = static_cast<unsigned __int64>(_ftelli64_nolock(m_fp));
+        log_lz_block_header bh;
+        bh.raw_size = static_cast<unsigned int>(len);
+        bh.size = bh.raw_size | log_lz_block_header::stored;
+        _fwrite_nolock(&bh, sizeof(bh), 1, m_fp);
+        _fwrite_nolock(data, 1, len, m_fp);
+        if (m_index_fp) _fwrite_nolock(&e, sizeof(e), 1, m_index_fp);
+    }
+
+    bool begin_write()
+    {
+        if (!m_fp) return false;
+        check_rotate();
+        if (!m_fp) return false;
+        if (!m_block) begin_block();
+        return true;
+    }
+
+    void begin_block()
+    {
+        {
+            autolocker<critical_section_lock> locker(m_queue_lock);
+            if (!m_free.empty())
+            {
+                m_block = m_free.front();
+                m_free.pop_front();
+            }
+        }
+        if (!m_block) m_block = new block;
+        m_block->text.clear();
+        m_block->time = log_index::now();
+        m_block_tick = ::GetTickCount();
+    }
+
+    //! a block never grows past max_raw_size (see log_lz_reader), a huge batch is cut into blocks
+    void append_block(const char * buf, size_t len)
+    {
+        while (m_block->text.length() + len > log_lz_block_header::max_raw_size)
+        {
+            size_t take = log_lz_block_header::max_raw_size - m_block->text.length();
+            m_block->text.append(buf, take);
+            buf += take;
+            len -= take;
+            submit_block();
+            begin_block();
+        }
+        m_block->text.append(buf, len);
+    }
+
+    size_t end_write(size_t n)
+    {
+        if (m_block->text.length() >= m_block_size) submit_block();
+        return n;
+    }
+
+    //! hands the current block to the compressor, waits while too many blocks are ahead of it
+    void submit_block()
+    {
+        if (!m_block) return;
+        if (m_block->text.empty() || !m_compressor)
+        {
+            if (!m_compressor) write_block(*m_block);
+            autolocker<critical_section_lock> locker(m_queue_lock);
+            m_free.push_back(m_block);
+            m_block = NULL;
+            return;
+        }
+
+        {
+            autolocker<critical_section_lock> locker(m_queue_lock);
+            m_queue.push_back(m_block);
+            m_block = NULL;
+        }
+        ::InterlockedIncrement(&m_in_flight);
+        ::SetEvent(m_work);
+        while (m_in_flight >= max_in_flight) ::WaitForSingleObject(m_done, INFINITE);
+    }
+
+    void wait_idle()
+    {
+        while (m_in_flight > 0) ::WaitForSingleObject(m_done, INFINITE);
+    }
+
+    //! compresses and appends one block and its index entry, runs on the compressor thread
+    void write_block(const block& b)
+    {
+        if (!m_fp || b.text.empty()) return;
+        size_t len = b.text.length();
+        m_packed.resize(log_lz_bound(len));
+        size_t n = log_lz_compress(b.text.c_str(), len, &m_packed[0]);
+
+        log_lz_block_header bh;
+        bh.raw_size = static_cast<unsigned int>(len);
+        const char * data = m_packed.c_str();
+        if (n < len)
+        {
+            bh.size = static_cast<unsigned int>(n);
+        }
+        else
+        {
+            data = b.text.c_str();
+            n = len;
+            bh.size = static_cast<unsigned int>(len) | log_lz_block_header::stored;
+        }
+
+        log_index_entry e;
+        e.time = b.time;
+        e.offset = static_cast<unsigned __int64>(_ftelli64(m_fp));
+        fwrite(&bh, sizeof(bh), 1, m_fp);
+        fwrite(data, 1, n, m_fp);
+        fflush(m_fp);
+        // the writing thread reads it for the rotation check
+        ::InterlockedExchangeAdd64(reinterpret_cast<volatile LONGLONG *>(&m_size), static_cast<LONGLONG>(sizeof(bh) + n));
+        if (m_index_fp)
+        {
+            fwrite(&e, sizeof(e), 1, m_index_fp);
+            fflush(m_index_fp);
+        }
+    }
+
+    void start_compressor()
+    {
+        if (m_compressor) return;
+        m_stop_compressor = 0;
+        m_work = ::CreateEventW(NULL, FALSE, FALSE, NULL);
+        m_done = ::CreateEventW(NULL, FALSE, FALSE, NULL);
+        m_compressor = reinterpret_cast<HANDLE>(::_beginthreadex(NULL, 0, &ld_compressed_file::compressor_proc, this, 0, &m_compressor_tid));
+    }
+
+    void stop_compressor()
+    {
+        if (m_compressor)
+        {
+            ::InterlockedExchange(&m_stop_compressor, 1);
+            ::SetEvent(m_work);
+            ::WaitForSingleObject(m_compressor, INFINITE);
+            ::CloseHandle(m_compressor);
+            m_compressor = NULL;
+        }
+        if (m_work)
+        {
+            ::CloseHandle(m_work);
+            m_work = NULL;
+        }
+        if (m_done)
+        {
+            ::CloseHandle(m_done);
+            m_done = NULL;
+        }
+    }
+
+    static unsigned int __stdcall compressor_proc(void * param)
+    {
+        ld_compressed_file * self = static_cast<ld_compressed_file *>(param);
+        for (;;)
+        {
+            ::WaitForSingleObject(self->m_work, INFINITE);
+            for (;;)
+            {
+                block * b;
+                {
+                    autolocker<critical_section_lock> locker(self->m_queue_lock);
+                    if (self->m_queue.empty()) break;
+                    b = self->m_queue.front();
+                    self->m_queue.pop_front();
+                }
+                self->write_block(*b);
+                {
+                    autolocker<critical_section_lock> locker(self->m_queue_lock);
+                    self->m_free.push_back(b);
+                }
+                ::InterlockedDecrement(&self->m_in_flight);
+                ::SetEvent(self->m_done);
+            }
+            if (self->m_stop_compressor) break;
+        }
+        return 0;
+    }
+
+    size_t m_block_size;
+    DWORD m_max_delay;
+    block * m_block;
+    DWORD m_block_tick;
+    std::string m_packed;
+
+    HANDLE m_compressor;
+    unsigned int m_compressor_tid;
+    HANDLE m_work;
+    HANDLE m_done;
+    volatile LONG m_stop_compressor;
+    volatile LONG m_in_flight;
+    critical_section_lock m_queue_lock;
+    std::list<block *> m_queue;
+    std::list<block *> m_free;
+};
+
+/** copies UTF-8 straight into memory mapped, preallocated segment files
+* app.log.0000, app.log.0001, ... : a new segment is started when the current one is full.
+* written bytes are in the system file cache as soon as write() returns, so they survive a
+* crash of the process without any flush. the file is cut to its real length on close(),
+* a segment left by a crashed process is padded with '\0' up to segment_size. segments on
+* disk are never overwritten: open() continues after the highest one
+*/
+class ld_mmap_file : public log_device
+{
+public:
+    ld_mmap_file(const wchar_t * filename, size_t segment_size = 32 * 1024 * 1024)
+        : m_filename(filename)
+        , m_segment_size(segment_size < 4096 ? 4096 : segment_size)
+        , m_index(0)
+        , m_file(INVALID_HANDLE_VALUE)
+        , m_mapping(NULL)
+        , m_view(NULL)
+        , m_pos(0)
+    {
+    }
+
+    virtual bool open()
+    {
+        m_index = next_free_index();
+        return open_segment();
+    }
+
+    virtual bool close()
+    {
+        if (!m_view) return false;
+        close_segment();
+        return true;
+    }
+
+    using log_device::write;
+
+    virtual size_t write(const char * buf, size_t len, int)
+    {
+        size_t written = 0;
+        while (len > 0 && m_view)
+        {
+            size_t room = m_segment_size - m_pos;
+            if (room == 0)
+            {
+                roll();
+                continue;
+            }
+            size_t take = len < room ? len : room;
+            memcpy(m_view + m_pos, buf, take);
+            m_pos += take;
+            written += take;
+            buf += take;
+            len -= take;
+        }
+        return written;
+    }
+
+    // a line that does not fit into the rest of the segment starts the next one
+    virtual size_t writev(const log_segment * segs, size_t count)
+    {
+        size_t written = 0;
+        size_t line_begin = 0;
+        size_t line_len = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            line_len += segs[i].len;
+            bool eol = (segs[i].len > 0 && segs[i].buf[segs[i].len - 1] == '\n');
+            if (!eol && i + 1 < count) continue;
+
+            if (line_len > m_segment_size - m_pos && line_len <= m_segment_size) roll();
+            for (size_t j = line_begin; j <= i; j++) written += write(segs[j].buf, segs[j].len, segs[j].context_id);
+            line_begin = i + 1;
+            line_len = 0;
+        }
+        return written;
+    }
+
+    // nothing to do: the bytes already belong to the system file cache
+    virtual bool flush()
+    {
+        return true;
+    }
+
+    virtual bool sync()
+    {
+        if (!m_view) return false;
+        return ::FlushViewOfFile(m_view, m_pos) && ::FlushFileBuffers(m_file);
+    }
+
+    // starting a segment creates a file, a line that does not fit is skipped
+    virtual bool crash_write(const char * text, size_t len)
+    {
+        if (!m_view || len > m_segment_size - m_pos) return false;
+        memcpy(m_view + m_pos, text, len);
+        m_pos += len;
+        return true;
+    }
+
+    virtual bool crash_flush()
+    {
+        return m_view != NULL;
+    }
+
+    virtual ~ld_mmap_file()
+    {
+        close();
+    }
+
+protected:
+    //! one past the highest "<filename>.NNNN" on disk, 0 if there is none
+    unsigned int next_free_index() const
+    {
+        size_t slash = m_filename.find_last_of(L"\\/");
+        size_t base_len = m_filename.length() - (slash == std::wstring::npos ? 0 : slash + 1);
+        unsigned int next = 0;
+
+        WIN32_FIND_DATAW fd;
+        HANDLE h = ::FindFirstFileW((m_filename + L".*").c_str(), &fd);
+        if (h != INVALID_HANDLE_VALUE)
+        {
+            do
+            {
+                if (wcslen(fd.cFileName) < base_len + 5) continue;
+                const wchar_t * digits = fd.cFileName + base_len + 1;
+                size_t n = 0;
+                while (digits[n] >= L'0' && digits[n] <= L'9') n++;
+                if (n < 4 || digits[n] != 0) continue;
+                unsigned int index = static_cast<unsigned int>(wcstoul(digits, NULL, 10));
+                if (index + 1 > next) next = index + 1;
+            } while (::FindNextFileW(h, &fd));
+            ::FindClose(h);
+        }
+        return next;
+    }
+
+    // CREATE_NEW: a segment that appeared meanwhile is skipped, not truncated
+    bool open_segment()
+    {
+        for (;;)
+        {
+            std::wstring name = m_filename + static_cast<const wchar_t *>(cz(L".%04u", m_index));
+            m_file = ::CreateFileW(name.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (m_file != INVALID_HANDLE_VALUE) break;
+            if (::GetLastError() != ERROR_FILE_EXISTS) return false;
+            m_index++;
+        }
+
+        // mapping more than the file size grows (preallocates) the file
+        ULONGLONG size = m_segment_size;
+        m_mapping = ::CreateFileMappingW(m_file, NULL, PAGE_READWRITE, static_cast<DWORD>(size >> 32), static_cast<DWORD>(size & 0xFFFFFFFF), NULL);
+        if (m_mapping)
+        {
+            m_view = static_cast<char *>(::MapViewOfFile(m_mapping, FILE_MAP_WRITE, 0, 0, m_segment_size));
+        }
+        if (!m_view)
+        {
+            close_segment();
+            return false;
+        }
+        m_pos = 0;
+        return true;
+    }
+
+    void close_segment()
+    {
+        if (m_view) ::UnmapViewOfFile(m_view);
+        if (m_mapping) ::CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE)
+        {
+            LARGE_INTEGER li;
+            li.QuadPart = static_cast<LONGLONG>(m_pos);
+            ::SetFilePointerEx(m_file, li, NULL, FILE_BEGIN);
+            ::SetEndOfFile(m_file);
+            ::CloseHandle(m_file);
+        }
+        m_view = NULL;
+        m_mapping = NULL;
+        m_file = INVALID_HANDLE_VALUE;
+        m_pos = 0;
+    }
+
+    void roll()
+    {
+        close_segment();
+        m_index++;
+        open_segment();
+    }
+
+    std::wstring m_filename;
+    size_t m_segment_size;
+    unsigned int m_index;
+    HANDLE m_file;
+    HANDLE m_mapping;
+    char * m_view;
+    size_t m_pos;
+};
+
+/** gives a device its own queue and worker thread, so a slow or blocked device (a console
+* nobody reads, a full pipe) no longer holds up the logger and the other devices.
+* writes are copied into the queue and handed to the wrapped device by the worker in order.
+* when more than \a capacity writes are pending, \a policy decides:
+* block the logger, drop the new write or drop the oldest pending one. drops are counted.
+* @code
+*   tp::log_add_device(new tp::ld_queued(new tp::ld_console, 1024, tp::ld_queued::drop_oldest), 0xFF);
+* @endcode
+*/
+class ld_queued : public log_device
+{
+public:
+    enum overflow_policy
+    {
+        block,
+        drop_newest,
+        drop_oldest,
+    };
+
+    //! \a target is deleted with this device if \a auto_delete
+    ld_queued(log_device * target, size_t capacity = 1024, overflow_policy policy = block, bool auto_delete = true)
+        : m_target(target)
+        , m_capacity(capacity < 1 ? 1 : capacity)
+        , m_policy(policy)
+        , m_auto_delete(auto_delete)
+        , m_pending_count(0)
+        , m_in_flight(0)
+        , m_dropped(0)
+        , m_worker(NULL)
+        , m_worker_tid(0)
+        , m_wakeup(NULL)
+        , m_space(NULL)
+        , m_stop(0)
+        , m_flush_pending(0)
+        , m_sync_pending(0)
+    {
+    }
+
+    virtual ~ld_queued()
+    {
+        close();
+        if (m_auto_delete) delete m_target;
+    }
+
+    virtual bool open()
+    {
+        if (m_worker) return true;
+        if (!m_target->open()) return false;
+
+        m_stop = 0;
+        m_wakeup = ::CreateEventW(NULL, FALSE, FALSE, NULL);
+        m_space = ::CreateEventW(NULL, FALSE, FALSE, NULL);
+        m_worker = reinterpret_cast<HANDLE>(::_beginthreadex(NULL, 0, &ld_queued::worker_proc, this, 0, &m_worker_tid));
+        return m_worker != NULL;
+    }
+
+    //! writes out what is pending, then closes the wrapped device
+    virtual bool close()
+    {
+        if (!m_worker) return false;
+
+        ::InterlockedExchange(&m_stop, 1);
+        ::SetEvent(m_wakeup);
+        ::WaitForSingleObject(m_worker, INFINITE);
+        ::CloseHandle(m_worker);
+        ::CloseHandle(m_wakeup);
+        ::CloseHandle(m_space);
+        m_worker = NULL;
+        m_wakeup = NULL;
+        m_space = NULL;
+        return m_target->close();
+    }
+
+    using log_device::write;
+    virtual size_t write(const char * buf, size_t len, int context_id)
+    {
+        log_segment seg = { buf, len, context_id };
+        return writev(&seg, 1);
+    }
+
+    virtual size_t writev(const log_segment * segs, size_t count)
+    {
+        size_t total = 0;
+        for (size_t i = 0; i < count; i++) total += segs[i].len;
+
+        autolocker<critical_section_lock> locker(m_lock);
+        while (m_pending_count >= m_capacity)
+        {
+            if (m_policy == drop_newest || !m_worker)
+            {
+                ::InterlockedIncrement(&m_dropped);
+                return total;
+            }
+            if (m_policy == drop_oldest)
+            {
+                drop_oldest_write();
+                continue;
+            }
+            // block: wait for the worker to take the pending writes
+            m_lock.unlock();
+            ::WaitForSingleObject(m_space, 100);
+            m_lock.lock();
+        }
+
+        std::list<request>::iterator it = new_request();
+        request& r = *it;
+        r.text.reserve(total);
+        for (size_t i = 0; i < count; i++)
+        {
+            piece pc = { segs[i].len, segs[i].context_id };
+            r.text.append(segs[i].buf, segs[i].len);
+            r.pieces.push_back(pc);
+        }
+        m_pending_count++;
+        ::InterlockedIncrement(&m_in_flight);
+        ::SetEvent(m_wakeup);
+        return total;
+    }
+
+    /** done by the worker after the writes pending now, never dropped. calls made while the
+    * worker is busy come down to one flush of the target
+    */
+    virtual bool flush()
+    {
+        return post_flag(m_flush_pending);
+    }
+
+    virtual bool sync()
+    {
+        return post_flag(m_sync_pending);
+    }
+
+    /** gives the worker up to a second to write what is pending, unless it is the one crashing.
+    * it waits for the batch the worker is writing too, the target is not flushed under its feet
+    */
+    virtual bool crash_flush()
+    {
+        crash_wait();
+        return m_target->crash_flush();
+    }
+
+    // the line goes to the target once the worker is done with it, it is not queued
+    virtual bool crash_write(const char * text, size_t len)
+    {
+        return crash_wait() && m_target->crash_write(text, len);
+    }
+
+    //! writes dropped by the overflow policy so far
+    virtual long dropped() const
+    {
+        return m_dropped;
+    }
+
+    //! writes waiting for the worker
+    virtual size_t pending() const
+    {
+        return m_pending_count;
+    }
+
+    log_device * target() const
+    {
+        return m_target;
+    }
+
+private:
+    struct piece
+    {
+        size_t len;
+        int context_id;
+    };
+
+    struct request
+    {
+        std::string text;
+        std::vector<piece> pieces;
+    };
+
+    //! a cleared request at the end of m_queue, taken from m_free when possible. under m_lock
+    std::list<request>::iterator new_request()
+    {
+        if (m_free.empty()) m_free.push_back(request());
+        m_queue.splice(m_queue.end(), m_free, m_free.begin());
+        std::list<request>::iterator it = --m_queue.end();
+        it->text.clear();
+        it->pieces.clear();
+        return it;
+    }
+
+    //! on the crashing thread: up to a second for the worker, true once it has written everything
+    bool crash_wait() const
+    {
+        if (m_worker && ::GetCurrentThreadId() != m_worker_tid)
+        {
+            for (int i = 0; i < 1000 && m_in_flight > 0; i++) ::Sleep(1);
+        }
+        return m_in_flight == 0;
+    }
+
+    void drop_oldest_write()
+    {
+        if (m_queue.empty()) return;
+        m_free.splice(m_free.end(), m_queue, m_queue.begin());
+        m_pending_count--;
+        ::InterlockedDecrement(&m_in_flight);
+        ::InterlockedIncrement(&m_dropped);
+    }
+
+    bool post_flag(volatile LONG& flag)
+    {
+        if (!m_worker) return false;
+        ::InterlockedExchange(&flag, 1);
+        ::SetEvent(m_wakeup);
+        return true;
+    }
+
+    static unsigned int __stdcall worker_proc(void * param)
+    {
+        static_cast<ld_queued *>(param)->work();
+        return 0;
+    }
+
+    void work()
+    {
+        std::list<request> batch;
+        std::vector<log_segment> segs;
+        for (;;)
+        {
+            ::WaitForSingleObject(m_wakeup, INFINITE);
+            for (;;)
+            {
+                bool stop = (m_stop != 0);
+                // taken before the batch, so a flush covers every write queued before it was asked for
+                bool sync = ::InterlockedExchange(&m_sync_pending, 0) != 0;
+                bool flush = ::InterlockedExchange(&m_flush_pending, 0) != 0;
+                {
+                    autolocker<critical_section_lock> locker(m_lock);
+                    batch.splice(batch.end(), m_queue);
+                    m_pending_count = 0;
+                }
+                LONG taken = static_cast<LONG>(batch.size());
+                ::SetEvent(m_space);
+                if (batch.empty() && !sync && !flush)
+                {
+                    if (stop) return;
+                    break;
+                }
+
+                for (std::list<request>::iterator it = batch.begin(); it != batch.end(); ++it)
+                {
+                    if (!it->pieces.empty())
+                    {
+                        segs.resize(it->pieces.size());
+                        const char * p = it->text.c_str();
+                        for (size_t i = 0; i < it->pieces.size(); i++)
+                        {
+                            segs[i].buf = p;
+                            segs[i].len = it->pieces[i].len;
+                            segs[i].context_id = it->pieces[i].context_id;
+                            p += it->pieces[i].len;
+                        }
+                        m_target->writev(&segs[0], segs.size());
+                    }
+                }
+                if (sync) m_target->sync();
+                else if (flush) m_target->flush();
+                ::InterlockedExchangeAdd(&m_in_flight, -taken);
+
+                autolocker<critical_section_lock> locker(m_lock);
+                m_free.splice(m_free.end(), batch);
+            }
+        }
+    }
+
+    log_device * m_target;
+    size_t m_capacity;
+    overflow_policy m_policy;
+    bool m_auto_delete;
+
+    critical_section_lock m_lock;
+    std::list<request> m_queue;
+    std::list<request> m_free;
+    volatile size_t m_pending_count;    // in m_queue, under m_lock
+    volatile LONG m_in_flight;          // accepted and not yet written by the worker
+    volatile LONG m_dropped;
+
+    HANDLE m_worker;
+    unsigned int m_worker_tid;
+    HANDLE m_wakeup;
+    HANDLE m_space;
+    volatile LONG m_stop;
+    volatile LONG m_flush_pending;  // set by flush(), taken by the worker after its current batch
+    volatile LONG m_sync_pending;
+};
+
+/** ships the log to a local collector (a log agent, a sidecar) over a named pipe, instead of
+* a file the collector tails and reads a second time. the collector creates the pipe, in
+* message mode it receives whole lines, up to \a max_batch bytes per message.
+* @code
+*   tp::log_add_device(new tp::ld_pipe(L"\\\\.\\pipe\\app-log"), 0xFF);
+* @endcode
+* the logger only appends to a buffer, a sender thread writes it to the pipe every
+* \a max_delay_ms or as soon as a batch is full. \a capacity bounds the bytes accepted and
+* not yet delivered, including those the sender is working on. while there is no collector, or
+* all its pipe instances are busy, the sender tries again every \a retry_ms. the logger never
+* waits for the collector: a write that does not fit into the buffer is dropped and counted.
+*/
+class ld_pipe : public log_device
+{
+public:
+    ld_pipe(const wchar_t * pipe_name, size_t capacity = 1024 * 1024, size_t max_batch = 64 * 1024,
+        unsigned int max_delay_ms = 100, unsigned int retry_ms = 1000)
+        : m_name(pipe_name)
+        , m_capacity(capacity)
+        , m_max_batch(max_batch < 1 ? 1 : max_batch)
+        , m_max_delay(max_delay_ms)
+        , m_retry(retry_ms)
+        , m_buffered(0)
+        , m_sent_bytes(0)
+        , m_sent_count(0)
+        , m_pending_count(0)
+        , m_dropped(0)
+        , m_sent(0)
+        , m_connects(0)
+        , m_pipe(INVALID_HANDLE_VALUE)
+        , m_sender(NULL)
+        , m_sender_tid(0)
+        , m_wakeup(NULL)
+        , m_io_done(NULL)
+        , m_stop(0)
+        , m_stop_tick(0)
+    {
+    }
+
+    virtual ~ld_pipe()
+    {
+        close();
+    }
+
+    virtual bool open()
+    {
+        if (m_sender) return true;
+
+        m_pending.reserve(m_capacity);
+        m_stop = 0;
+        m_wakeup = ::CreateEventW(NULL, FALSE, FALSE, NULL);
+        m_io_done = ::CreateEventW(NULL, TRUE, FALSE, NULL);
+        if (!m_wakeup || !m_io_done) return false;
+        m_sender = reinterpret_cast<HANDLE>(::_beginthreadex(NULL, 0, &ld_pipe::sender_proc, this, 0, &m_sender_tid));
+        return m_sender != NULL;
+    }
+
+    //! gives the sender up to a second to deliver what is pending, the rest is dropped
+    virtual bool close()
+    {
+        if (!m_sender) return false;
+
+        m_stop_tick = ::GetTickCount();
+        ::InterlockedExchange(&m_stop, 1);
+        ::SetEvent(m_wakeup);
+        ::WaitForSingleObject(m_sender, INFINITE);
+        ::CloseHandle(m_sender);
+        ::CloseHandle(m_wakeup);
+        ::CloseHandle(m_io_done);
+        m_sender = NULL;
+        m_wakeup = NULL;
+        m_io_done = NULL;
+        return true;
+    }
+
+    using log_device::write;
+    virtual size_t write(const char * buf, size_t len, int context_id)
+    {
+        log_segment seg = { buf, len, context_id };
+        return writev(&seg, 1);
+    }
+
+    virtual size_t writev(const log_segment * segs, size_t count)
+    {
+        size_t total = 0;
+        for (size_t i = 0; i < count; i++) total += segs[i].len;
+        if (total == 0) return 0;
+
+        autolocker<critical_section_lock> locker(m_lock);
+        if (!m_sender || m_buffered + total > m_capacity)
+        {
+            ::InterlockedIncrement(&m_dropped);
+            return total;
+        }
+        m_buffered += total;
+        for (size_t i = 0; i < count; i++) m_pending.append(segs[i].buf, segs[i].len);
+        m_pending_sizes.push_back(total);
+        ::InterlockedIncrement(&m_pending_count);
+        if (m_pending.length() >= m_max_batch) ::SetEvent(m_wakeup);
+        return total;
+    }
+
+    //! has the sender write what is pending now instead of after max_delay_ms, does not wait
+    virtual bool flush()
+    {
+        if (!m_sender) return false;
+        ::SetEvent(m_wakeup);
+        return true;
+    }
+
+    /** gives the sender up to a second, unless it is the one crashing or there is no collector.
+    * it waits for the bytes the sender has taken as well as the pending ones
+    */
+    virtual bool crash_flush()
+    {
+        if (!m_sender || ::GetCurrentThreadId() == m_sender_tid) return false;
+        ::SetEvent(m_wakeup);
+        for (int i = 0; i < 1000 && m_buffered > 0 && connected(); i++) ::Sleep(1);
+        return true;
+    }
+
+    //! writes dropped because the buffer was full or left over at close
+    virtual long dropped() const
+    {
+        return m_dropped;
+    }
+
+    //! writes not yet delivered to the collector
+    virtual size_t pending() const
+    {
+        return static_cast<size_t>(m_pending_count);
+    }
+
+    //! writes delivered to the collector
+    long sent() const
+    {
+        return m_sent;
+    }
+
+    //! successful connects, more than one means the collector went away in between
+    long connects() const
+    {
+        return m_connects;
+    }
+
+    bool connected() const
+    {
+        return m_pipe != INVALID_HANDLE_VALUE;
+    }
+
+private:
+    ld_pipe(const ld_pipe&);
+    ld_pipe& operator=(const ld_pipe&);
+
+    static unsigned int __stdcall sender_proc(void * param)
+    {
+        static_cast<ld_pipe *>(param)->work();
+        return 0;
+    }
+
+    void work()
+    {
+        DWORD last_try = ::GetTickCount() - m_retry;
+        for (;;)
+        {
+            ::WaitForSingleObject(m_wakeup, m_max_delay);
+            if (m_stop) break;
+            if (!take()) continue;
+            if (!connected() && ::GetTickCount() - last_try >= m_retry)
+            {
+                last_try = ::GetTickCount();
+                connect();
+            }
+            if (connected()) send();
+        }
+
+        // a last round, limited by close_timeout
+        if (!connected()) connect();
+        while (connected() && take() && send())
+        {
+        }
+        disconnect();
+
+        autolocker<critical_section_lock> locker(m_lock);
+        size_t left = (m_sending_sizes.size() - m_sent_count) + m_pending_sizes.size();
+        ::InterlockedExchangeAdd(&m_dropped, static_cast<LONG>(left));
+        ::InterlockedExchange(&m_pending_count, 0);
+        m_sending.clear();
+        m_sending_sizes.clear();
+        m_pending.clear();
+        m_pending_sizes.clear();
+        m_buffered = 0;
+        m_sent_bytes = 0;
+        m_sent_count = 0;
+    }
+
+    //! moves the pending writes to the sender once the previous ones are out, false if there is nothing to send
+    bool take()
+    {
+        if (m_sent_count < m_sending_sizes.size()) return true;
+
+        m_sending.clear();
+        m_sending_sizes.clear();
+        m_sent_bytes = 0;
+        m_sent_count = 0;
+        autolocker<critical_section_lock> locker(m_lock);
+        m_sending.swap(m_pending);
+        m_sending_sizes.swap(m_pending_sizes);
+        return !m_sending_sizes.empty();
+    }
+
+    //! does not wait: a collector that is missing or busy is tried again later
+    bool connect()
+    {
+        m_pipe = ::CreateFileW(m_name.c_str(), GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+        if (m_pipe == INVALID_HANDLE_VALUE) return false;
+        ::InterlockedIncrement(&m_connects);
+        return true;
+    }
+
+    void disconnect()
+    {
+        if (m_pipe == INVALID_HANDLE_VALUE) return;
+        ::CloseHandle(m_pipe);
+        m_pipe = INVALID_HANDLE_VALUE;
+    }
+
+    /** writes what take() moved to the sender, batches of whole writes of up to max_batch bytes.
+    * a broken pipe disconnects, what was not delivered is sent again after the next connect
+    */
+    bool send()
+    {
+        while (m_sent_count < m_sending_sizes.size())
+        {
+            size_t n = 0;
+            size_t bytes = 0;
+            do
+            {
+                bytes += m_sending_sizes[m_sent_count + n];
+                n++;
+            } while (m_sent_count + n < m_sending_sizes.size() && bytes + m_sending_sizes[m_sent_count + n] <= m_max_batch);
+
+            if (!write_pipe(m_sending.c_str() + m_sent_bytes, bytes))
+            {
+                disconnect();
+                return false;
+            }
+            {
+                autolocker<critical_section_lock> locker(m_lock);
+                m_buffered -= bytes;
+            }
+            m_sent_bytes += bytes;
+            m_sent_count += n;
+            ::InterlockedExchangeAdd(&m_sent, static_cast<LONG>(n));
+            ::InterlockedExchangeAdd(&m_pending_count, -static_cast<LONG>(n));
+        }
+        return true;
+    }
+
+    //! overlapped, so a collector that stopped reading cannot hold up close() for longer than close_timeout
+    bool write_pipe(const char * buf, size_t len)
+    {
+        OVERLAPPED ov;
+        memset(&ov, 0, sizeof(ov));
+        ov.hEvent = m_io_done;
+        ::ResetEvent(m_io_done);
+
+        DWORD written = 0;
+        if (!::WriteFile(m_pipe, buf, static_cast<DWORD>(len), &written, &ov))
+        {
+            if (::GetLastError() != ERROR_IO_PENDING) return false;
+            while (::WaitForSingleObject(m_io_done, 100) == WAIT_TIMEOUT)
+            {
+                if (m_stop && ::GetTickCount() - m_stop_tick >= close_timeout) ::CancelIo(m_pipe);
+            }
+            if (!::GetOverlappedResult(m_pipe, &ov, &written, TRUE)) return false;
+        }
+        return written == len;
+    }
+
+    enum { close_timeout = 1000 };
+
+    std::wstring m_name;
+    size_t m_capacity;
+    size_t m_max_batch;
+    unsigned int m_max_delay;
+    unsigned int m_retry;
+
+    critical_section_lock m_lock;
+    std::string m_pending;
+    std::vector<size_t> m_pending_sizes;
+    volatile size_t m_buffered; // bytes in m_pending and not yet sent from m_sending, changed under m_lock
+
+    // sender thread only
+    std::string m_sending;
+    std::vector<size_t> m_sending_sizes;
+    size_t m_sent_bytes;
+    size_t m_sent_count;
+
+    volatile LONG m_pending_count;
+    volatile LONG m_dropped;
+    volatile LONG m_sent;
+    volatile LONG m_connects;
+
+    HANDLE m_pipe;
+    HANDLE m_sender;
+    unsigned int m_sender_tid;
+    HANDLE m_wakeup;
+    HANDLE m_io_done;
+    volatile LONG m_stop;
+    DWORD m_stop_tick;
+};
+
 /*
 class ld_xml_file : public ld_file
 {
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <windows.h>
+#include <stdio.h>
+#include <share.h>
+#include <string>
+#include <vector>
+
+/** \file log_index.h
+
+ sparse time index of a log file: ld_file::enable_index makes the device append an entry
+ (time, byte offset of a line start) to "<log file>.idx" every few KB. a reader binary
+ searches the entries and seeks straight to a time range instead of scanning the file.
+
+ @code
+   tp::log_index idx;
+   std::string text;
+   if (idx.load(L"app.log"))
+       idx.read_range(tp::log_index::from_local(st_begin), tp::log_index::from_local(st_end), text);
+ @endcode
+ */
+
+namespace tp
+{
+    //! one index entry, times are FILETIME (UTC, 100ns units)
+    struct log_index_entry
+    {
+        unsigned __int64 time;
+        unsigned __int64 offset;
+    };
+
+    inline std::wstring log_index_name(const std::wstring& log_file)
+    {
+        return log_file + L".idx";
+    }
+
+    class log_index
+    {
+    public:
+        //! reads the index of \a log_file
+        bool load(const wchar_t * log_file)
+        {
+            m_log_file = log_file;
+            m_entries.clear();
+            FILE * fp = _wfsopen(log_index_name(m_log_file).c_str(), L"rb", _SH_DENYNO);
+            if (!fp) return false;
+
+            log_index_entry buf[512];
+            size_t n;
+            while ((n = fread(buf, sizeof(buf[0]), sizeof(buf)/sizeof(buf[0]), fp)) > 0)
+            {
+                m_entries.insert(m_entries.end(), buf, buf + n);
+            }
+            fclose(fp);
+            return true;
+        }
+
+        size_t size() const
+        {
+            return m_entries.size();
+        }
+
+        const log_index_entry& operator[](size_t i) const
+        {
+            return m_entries[i];
+        }
+
+        //! offset of a line written at or before \a time, start reading there to miss nothing
+        unsigned __int64 find(unsigned __int64 time) const
+        {
+            size_t i = upper_bound(time);
+            return i > 0 ? m_entries[i - 1].offset : 0;
+        }
+
+        //! offset of a line written after \a time, ~0 if the end of the file is the first
+        unsigned __int64 find_end(unsigned __int64 time) const
+        {
+            size_t i = upper_bound(time);
+            return i < m_entries.size() ? m_entries[i].offset : ~static_cast<unsigned __int64>(0);
+        }
+
+        /** reads the part of the log that holds the lines written between \a from and \a to,
+        * give or take the index interval at both ends
+        */
+        bool read_range(unsigned __int64 from, unsigned __int64 to, std::string& out) const
+        {
+            out.clear();
+            FILE * fp = _wfsopen(m_log_file.c_str(), L"rb", _SH_DENYNO);
+            if (!fp) return false;
+
+            unsigned __int64 begin = find(from);
+            unsigned __int64 end = find_end(to);
+            bool ok = (_fseeki64(fp, static_cast<__int64>(begin), SEEK_SET) == 0);
+            char buf[64 * 1024];
+            while (ok && begin < end)
+            {
+                size_t want = sizeof(buf);
+                if (end - begin < want) want = static_cast<size_t>(end - begin);
+                size_t n = fread(buf, 1, want, fp);
+                if (n == 0) break;
+                out.append(buf, n);
+                begin += n;
+            }
+            fclose(fp);
+            return ok;
+        }
+
+        //! local time to the FILETIME the index uses
+        static unsigned __int64 from_local(const SYSTEMTIME& local)
+        {
+            FILETIME lft;
+            FILETIME ft;
+            if (!::SystemTimeToFileTime(&local, &lft) || !::LocalFileTimeToFileTime(&lft, &ft)) return 0;
+            return (static_cast<unsigned __int64>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+        }
+
+        static unsigned __int64 now()
+        {
+            FILETIME ft;
+            ::GetSystemTimeAsFileTime(&ft);
+            return (static_cast<unsigned __int64>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+        }
+
+    private:
+        //! first entry later than \a time
+        size_t upper_bound(unsigned __int64 time) const
+        {
+            size_t lo = 0;
+            size_t hi = m_entries.size();
+            while (lo < hi)
+            {
+                size_t mid = lo + (hi - lo) / 2;
+                if (m_entries[mid].time <= time) lo = mid + 1;
+                else hi = mid;
+            }
+            return lo;
+        }
+
+        std::wstring m_log_file;
+        std::vector<log_index_entry> m_entries;
+    };
+}
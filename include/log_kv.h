@@ -0,0 +1,455 @@
+#pragma once
+
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+#include <share.h>
+#include <string>
+#include <vector>
+#include "format_shim.h"
+
+/** \file log_kv.h
+
+ structured log records: a message plus typed key/value fields, encoded in a compact
+ binary form instead of being formatted into text.
+
+ @code
+   tp::log_kv(1, "login", {"user", name}, {"ms", elapsed}, {"ok", true});
+ @endcode
+
+ a record is little-endian and length-prefixed, so a reader can skip what it does not know:
+
+   u32 size                 bytes that follow
+   u64 time                 FILETIME, 100ns units since 1601-01-01 UTC
+   u32 tid
+   u8  type
+   u16 length, message      UTF-8
+   u8  field count
+   field: u8 length, key; u8 tag; value
+       'i' i64, 'u' u64, 'd' double, 'b' u8, 's' u32 length + UTF-8
+
+ text devices get the record rendered as "message key=value ...", devices that store
+ records (ld_kv_file) get the binary form. log_kv_reader reads the files back.
+ */
+
+namespace tp
+{
+    //! one key/value pair of a structured record, \a key must be a literal or outlive the call
+    struct log_kv_field
+    {
+        enum tag
+        {
+            tag_none = 0,
+            tag_int = 'i',
+            tag_uint = 'u',
+            tag_double = 'd',
+            tag_bool = 'b',
+            tag_str = 's',
+            tag_wstr = 'w',     // converted to tag_str when encoded
+        };
+
+        const char * key;
+        tag type;
+        long long i;
+        unsigned long long u;
+        double d;
+        const char * s;
+        const wchar_t * ws;
+        size_t len;
+
+        log_kv_field() : key(NULL), type(tag_none) { init(); }
+        log_kv_field(const char * k, bool v) : key(k), type(tag_bool) { init(); i = v ? 1 : 0; }
+        log_kv_field(const char * k, int v) : key(k), type(tag_int) { init(); i = v; }
+        log_kv_field(const char * k, long v) : key(k), type(tag_int) { init(); i = v; }
+        log_kv_field(const char * k, long long v) : key(k), type(tag_int) { init(); i = v; }
+        log_kv_field(const char * k, unsigned int v) : key(k), type(tag_uint) { init(); u = v; }
+        log_kv_field(const char * k, unsigned long v) : key(k), type(tag_uint) { init(); u = v; }
+        log_kv_field(const char * k, unsigned long long v) : key(k), type(tag_uint) { init(); u = v; }
+        log_kv_field(const char * k, double v) : key(k), type(tag_double) { init(); d = v; }
+        log_kv_field(const char * k, float v) : key(k), type(tag_double) { init(); d = v; }
+        log_kv_field(const char * k, const char * v) : key(k), type(tag_str) { init(); s = v ? v : ""; len = strlen(s); }
+        log_kv_field(const char * k, const std::string& v) : key(k), type(tag_str) { init(); s = v.c_str(); len = v.length(); }
+        log_kv_field(const char * k, const wchar_t * v) : key(k), type(tag_wstr) { init(); ws = v ? v : L""; len = wcslen(ws); }
+        log_kv_field(const char * k, const std::wstring& v) : key(k), type(tag_wstr) { init(); ws = v.c_str(); len = v.length(); }
+
+    private:
+        void init()
+        {
+            i = 0;
+            u = 0;
+            d = 0;
+            s = NULL;
+            ws = NULL;
+            len = 0;
+        }
+    };
+
+    namespace _inner
+    {
+        template <typename V>
+        void log_kv_put(std::string& out, V v)
+        {
+            out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+        }
+
+        template <typename V>
+        V log_kv_get(const char *& p)
+        {
+            V v;
+            memcpy(&v, p, sizeof(v));
+            p += sizeof(v);
+            return v;
+        }
+
+        inline unsigned __int64 log_kv_now()
+        {
+            FILETIME ft;
+            ::GetSystemTimeAsFileTime(&ft);
+            return (static_cast<unsigned __int64>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+        }
+    }
+
+    //! appends one encoded record to \a out, fields with a NULL key are skipped
+    inline void log_kv_encode(std::string& out, unsigned __int64 time, DWORD tid, unsigned int type,
+        const char * msg, const log_kv_field * fields, size_t count)
+    {
+        size_t start = out.length();
+        _inner::log_kv_put(out, static_cast<unsigned int>(0));
+        _inner::log_kv_put(out, time);
+        _inner::log_kv_put(out, static_cast<unsigned int>(tid));
+        _inner::log_kv_put(out, static_cast<unsigned char>(type));
+
+        size_t msg_len = msg ? strlen(msg) : 0;
+        if (msg_len > 0xFFFF) msg_len = 0xFFFF;
+        _inner::log_kv_put(out, static_cast<unsigned short>(msg_len));
+        out.append(msg ? msg : "", msg_len);
+
+        size_t count_pos = out.length();
+        unsigned char n = 0;
+        out += '\0';
+        for (size_t f = 0; f < count && n < 0xFF; f++)
+        {
+            const log_kv_field& kv = fields[f];
+            if (!kv.key) continue;
+            size_t key_len = strlen(kv.key);
+            if (key_len > 0xFF) key_len = 0xFF;
+            out += static_cast<char>(key_len);
+            out.append(kv.key, key_len);
+
+            switch (kv.type)
+            {
+            case log_kv_field::tag_int:
+                out += static_cast<char>(kv.type);
+                _inner::log_kv_put(out, kv.i);
+                break;
+            case log_kv_field::tag_uint:
+                out += static_cast<char>(kv.type);
+                _inner::log_kv_put(out, kv.u);
+                break;
+            case log_kv_field::tag_double:
+                out += static_cast<char>(kv.type);
+                _inner::log_kv_put(out, kv.d);
+                break;
+            case log_kv_field::tag_bool:
+                out += static_cast<char>(kv.type);
+                out += static_cast<char>(kv.i ? 1 : 0);
+                break;
+            case log_kv_field::tag_wstr:
+                {
+                    out += static_cast<char>(log_kv_field::tag_str);
+                    int len = kv.len ? ::WideCharToMultiByte(CP_UTF8, 0, kv.ws, static_cast<int>(kv.len), NULL, 0, NULL, NULL) : 0;
+                    if (len < 0) len = 0;
+                    _inner::log_kv_put(out, static_cast<unsigned int>(len));
+                    size_t pos = out.length();
+                    out.resize(pos + static_cast<size_t>(len));
+                    if (len > 0) ::WideCharToMultiByte(CP_UTF8, 0, kv.ws, static_cast<int>(kv.len), &out[pos], len, NULL, NULL);
+                }
+                break;
+            default:
+                out += static_cast<char>(log_kv_field::tag_str);
+                _inner::log_kv_put(out, static_cast<unsigned int>(kv.len));
+                out.append(kv.s ? kv.s : "", kv.len);
+                break;
+            }
+            n++;
+        }
+        out[count_pos] = static_cast<char>(n);
+
+        unsigned int size = static_cast<unsigned int>(out.length() - start - sizeof(unsigned int));
+        memcpy(&out[start], &size, sizeof(size));
+    }
+
+    //! a decoded record
+    struct log_kv_record
+    {
+        struct field
+        {
+            std::string key;
+            char tag;               // see log_kv_field::tag, strings are always 's'
+            long long i;            // also holds 'b'
+            unsigned long long u;
+            double d;
+            std::string s;
+        };
+
+        unsigned __int64 time;
+        DWORD tid;
+        unsigned int type;
+        std::string msg;
+        std::vector<field> fields;
+
+        log_kv_record() : time(0), tid(0), type(0)
+        {
+        }
+
+        /** decodes the record at \a p, \a len includes the size prefix.
+        * returns false if the data is truncated or malformed
+        */
+        bool parse(const char * p, size_t len)
+        {
+            const char * end = p + len;
+            fields.clear();
+            if (len < 4 + 8 + 4 + 1 + 2) return false;
+            unsigned int size = _inner::log_kv_get<unsigned int>(p);
+            if (size > len - 4) return false;
+            end = p + size;
+            time = _inner::log_kv_get<unsigned __int64>(p);
+            tid = _inner::log_kv_get<unsigned int>(p);
+            type = _inner::log_kv_get<unsigned char>(p);
+            size_t msg_len = _inner::log_kv_get<unsigned short>(p);
+            if (p + msg_len + 1 > end) return false;
+            msg.assign(p, msg_len);
+            p += msg_len;
+
+            size_t n = _inner::log_kv_get<unsigned char>(p);
+            for (size_t k = 0; k < n; k++)
+            {
+                if (p >= end) return false;
+                size_t key_len = _inner::log_kv_get<unsigned char>(p);
+                if (p + key_len + 1 > end) return false;
+                fields.push_back(field());
+                field& f = fields.back();
+                f.key.assign(p, key_len);
+                p += key_len;
+                f.tag = *p++;
+                f.i = 0;
+                f.u = 0;
+                f.d = 0;
+                switch (f.tag)
+                {
+                case log_kv_field::tag_int:
+                    if (p + 8 > end) return false;
+                    f.i = _inner::log_kv_get<long long>(p);
+                    break;
+                case log_kv_field::tag_uint:
+                    if (p + 8 > end) return false;
+                    f.u = _inner::log_kv_get<unsigned long long>(p);
+                    break;
+                case log_kv_field::tag_double:
+                    if (p + 8 > end) return false;
+                    f.d = _inner::log_kv_get<double>(p);
+                    break;
+                case log_kv_field::tag_bool:
+                    if (p + 1 > end) return false;
+                    f.i = *p++ ? 1 : 0;
+                    break;
+                case log_kv_field::tag_str:
+                    {
+                        if (p + 4 > end) return false;
+                        size_t str_len = _inner::log_kv_get<unsigned int>(p);
+                        if (p + str_len > end) return false;
+                        f.s.assign(p, str_len);
+                        p += str_len;
+                    }
+                    break;
+                default:
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        //! "message key=value key2=\"text\"", how text devices show the record
+        void to_text(std::string& out) const
+        {
+            out += msg;
+            for (size_t k = 0; k < fields.size(); k++)
+            {
+                out += ' ';
+                out += fields[k].key;
+                out += '=';
+                append_value(out, fields[k], false);
+            }
+        }
+
+        //! one JSON object: {"time":"2026-10-17T10:32:00.1234567Z","tid":12,"type":1,"msg":"...",<fields>}
+        void to_json(std::string& out) const
+        {
+            FILETIME ft;
+            ft.dwLowDateTime = static_cast<DWORD>(time & 0xFFFFFFFF);
+            ft.dwHighDateTime = static_cast<DWORD>(time >> 32);
+            SYSTEMTIME st;
+            ::FileTimeToSystemTime(&ft, &st);
+            out += static_cast<const char *>(czA("{\"time\":\"%04u-%02u-%02uT%02u:%02u:%02u.%07uZ\",\"tid\":%u,\"type\":%u,\"msg\":",
+                st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond,
+                static_cast<unsigned int>(time % 10000000), tid, type));
+            append_json_string(out, msg);
+            for (size_t k = 0; k < fields.size(); k++)
+            {
+                out += ',';
+                append_json_string(out, fields[k].key);
+                out += ':';
+                append_value(out, fields[k], true);
+            }
+            out += '}';
+        }
+
+    private:
+        static void append_value(std::string& out, const field& f, bool json)
+        {
+            switch (f.tag)
+            {
+            case log_kv_field::tag_int: out += static_cast<const char *>(czA("%lld", f.i)); break;
+            case log_kv_field::tag_uint: out += static_cast<const char *>(czA("%llu", f.u)); break;
+            case log_kv_field::tag_double: out += static_cast<const char *>(czA("%.17g", f.d)); break;
+            case log_kv_field::tag_bool: out += f.i ? "true" : "false"; break;
+            default:
+                if (json) append_json_string(out, f.s);
+                else out += '"' + f.s + '"';
+                break;
+            }
+        }
+
+        static void append_json_string(std::string& out, const std::string& s)
+        {
+            out += '"';
+            for (size_t k = 0; k < s.length(); k++)
+            {
+                unsigned char c = static_cast<unsigned char>(s[k]);
+                if (c == '"' || c == '\\') { out += '\\'; out += static_cast<char>(c); }
+                else if (c == '\n') out += "\\n";
+                else if (c == '\r') out += "\\r";
+                else if (c == '\t') out += "\\t";
+                else if (c < 0x20) out += static_cast<const char *>(czA("\\u%04x", c));
+                else out += static_cast<char>(c);
+            }
+            out += '"';
+        }
+    };
+
+    //! the header of a file written by ld_kv_file
+    struct log_kv_file_header
+    {
+        static const char * magic() { return "TPKV\x01\0\0\0"; }
+        enum { size = 8 };
+    };
+
+    /** reads the records of a file written by ld_kv_file
+    * @code
+    *   tp::log_kv_reader rd;
+    *   tp::log_kv_record rec;
+    *   if (rd.open(L"app.kv")) while (rd.next(rec)) { ... }
+    * @endcode
+    */
+    class log_kv_reader
+    {
+    public:
+        //! no record is larger, a size above it is a damaged file
+        enum { max_record = 16 * 1024 * 1024 };
+
+        log_kv_reader() : m_fp(NULL), m_file_size(0)
+        {
+        }
+
+        ~log_kv_reader()
+        {
+            close();
+        }
+
+        bool open(const wchar_t * filename)
+        {
+            close();
+            m_fp = _wfsopen(filename, L"rb", _SH_DENYNO);
+            if (!m_fp) return false;
+            _fseeki64(m_fp, 0, SEEK_END);
+            __int64 file_size = _ftelli64(m_fp);
+            m_file_size = file_size > 0 ? static_cast<unsigned __int64>(file_size) : 0;
+            _fseeki64(m_fp, 0, SEEK_SET);
+            char header[log_kv_file_header::size];
+            if (fread(header, 1, sizeof(header), m_fp) != sizeof(header) || memcmp(header, log_kv_file_header::magic(), sizeof(header)) != 0)
+            {
+                close();
+                return false;
+            }
+            return true;
+        }
+
+        void close()
+        {
+            if (m_fp)
+            {
+                fclose(m_fp);
+                m_fp = NULL;
+            }
+        }
+
+        //! false at the end of the file, at a truncated record (a crash while writing) or a damaged size
+        bool next(log_kv_record& rec)
+        {
+            if (!m_fp) return false;
+            unsigned int size;
+            if (fread(&size, 1, sizeof(size), m_fp) != sizeof(size)) return false;
+            __int64 pos = _ftelli64(m_fp);
+            if (size > max_record || pos < 0 || size > m_file_size - static_cast<unsigned __int64>(pos)) return false;
+            m_buf.resize(sizeof(size) + size);
+            memcpy(&m_buf[0], &size, sizeof(size));
+            if (size > 0 && fread(&m_buf[sizeof(size)], 1, size, m_fp) != size) return false;
+            return rec.parse(m_buf.c_str(), m_buf.length());
+        }
+
+    private:
+        log_kv_reader(const log_kv_reader&);
+        log_kv_reader& operator=(const log_kv_reader&);
+
+        FILE * m_fp;
+        unsigned __int64 m_file_size;
+        std::string m_buf;
+    };
+
+    //! converts a file written by ld_kv_file to text lines or JSON lines, returns the records converted
+    inline size_t log_kv_convert(const wchar_t * kv_file, const wchar_t * out_file, bool json)
+    {
+        log_kv_reader rd;
+        if (!rd.open(kv_file)) return 0;
+        FILE * out = _wfsopen(out_file, L"wb", _SH_DENYWR);
+        if (!out) return 0;
+
+        size_t n = 0;
+        log_kv_record rec;
+        std::string line;
+        while (rd.next(rec))
+        {
+            line.clear();
+            if (json)
+            {
+                rec.to_json(line);
+            }
+            else
+            {
+                FILETIME ft;
+                ft.dwLowDateTime = static_cast<DWORD>(rec.time & 0xFFFFFFFF);
+                ft.dwHighDateTime = static_cast<DWORD>(rec.time >> 32);
+                SYSTEMTIME st;
+                ::FileTimeToSystemTime(&ft, &st);
+                line += static_cast<const char *>(czA("%04u-%02u-%02u %02u:%02u:%02u.%03u %04u %u ",
+                    st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond, st.wMilliseconds, rec.tid, rec.type));
+                rec.to_text(line);
+            }
+            line += '\n';
+            fwrite(line.c_str(), 1, line.length(), out);
+            n++;
+        }
+        fclose(out);
+        return n;
+    }
+}
@@ -0,0 +1,235 @@
+#pragma once
+
+#include <windows.h>
+#include <process.h>
+#include "log.h"
+#include "format_shim.h"
+
+/** \file log_limit.h
+
+ per call site rate limiting and sampling, for hot paths that could flood the log:
+ @code
+   TP_LOG_RATE(3, 10, 20, L"send failed");     // 10 lines per second, bursts of 20
+   TP_LOG_SAMPLE(0, 1000, L"packet received"); // every 1000th line
+   TP_LOG_FIRST(2, 5, L"config key missing");  // the first 5 lines only
+   tp::log_start_limit_report(60000, 2);       // "file(line): n lines suppressed" every minute
+ @endcode
+
+ each statement keeps its state in a static log_site that is initialized at compile time,
+ so there is no lock and no guard. a suppressed line costs the type check, one read and
+ one interlocked increment of the suppressed count; its arguments are not evaluated.
+ */
+
+namespace tp
+{
+    /** state of one limited log statement, declared by the TP_LOG_RATE/SAMPLE/FIRST macros.
+    * a plain aggregate so a static one needs no runtime initialization
+    */
+    struct log_site
+    {
+        const char * file;
+        int line;
+        LONG limit;                 // lines per second, 1 in n or first k
+        LONG burst;                 // lines a rate limit lets through at once
+        volatile LONGLONG tat;      // rate limit: QueryPerformanceCounter time the next line is due
+        volatile LONG count;        // sampling and first k: lines seen
+        volatile LONG suppressed;   // since the last report
+        volatile LONG registered;
+        log_site * next;
+    };
+
+    namespace _inner
+    {
+        //! head of the list of sites that suppressed something, only ever grows
+        inline log_site * volatile & log_site_list()
+        {
+            static log_site * volatile s_head = NULL;
+            return s_head;
+        }
+
+        inline void log_site_suppress(log_site& site)
+        {
+            ::InterlockedIncrement(&site.suppressed);
+            if (!site.registered && ::InterlockedCompareExchange(&site.registered, 1, 0) == 0)
+            {
+                log_site * volatile & head = log_site_list();
+                log_site * old;
+                do
+                {
+                    old = head;
+                    site.next = old;
+                } while (::InterlockedCompareExchangePointer(reinterpret_cast<void * volatile *>(&head), &site, old) != old);
+            }
+        }
+
+        inline LONGLONG log_ticks_per_second()
+        {
+            static LONGLONG s_freq = 0;
+            if (s_freq == 0)
+            {
+                LARGE_INTEGER f;
+                ::QueryPerformanceFrequency(&f);
+                s_freq = f.QuadPart;
+            }
+            return s_freq;
+        }
+    }
+
+    /** token bucket as a single timestamp (GCRA): a line passes if it is not more than
+    * burst - 1 intervals ahead of schedule, one compare-exchange when it does
+    */
+    inline bool log_rate_pass(log_site& site)
+    {
+        if (site.limit <= 0) return true;
+        LONGLONG interval = _inner::log_ticks_per_second() / site.limit;
+        LONGLONG tolerance = interval * (site.burst > 1 ? site.burst - 1 : 0);
+        LONGLONG now = _inner::log_ticks();
+        for (;;)
+        {
+            LONGLONG tat = site.tat;
+            LONGLONG due = tat > now ? tat : now;
+            if (due - now > tolerance)
+            {
+                _inner::log_site_suppress(site);
+                return false;
+            }
+            if (::InterlockedCompareExchange64(&site.tat, due + interval, tat) == tat) return true;
+        }
+    }
+
+    //! lets the 1st, the n+1-th, the 2n+1-th ... line through
+    inline bool log_sample_pass(log_site& site)
+    {
+        if (site.limit <= 1) return true;
+        unsigned long n = static_cast<unsigned long>(::InterlockedIncrement(&site.count)) - 1;
+        if (n % static_cast<unsigned long>(site.limit) == 0) return true;
+        _inner::log_site_suppress(site);
+        return false;
+    }
+
+    //! lets the first k lines through, then only counts them
+    inline bool log_first_pass(log_site& site)
+    {
+        if (site.count < site.limit && ::InterlockedIncrement(&site.count) <= site.limit) return true;
+        _inner::log_site_suppress(site);
+        return false;
+    }
+
+    //! logs "file(line): n lines suppressed" as \a log_type for every site that suppressed lines since the last report
+    inline size_t log_limit_report(unsigned int log_type)
+    {
+        size_t sites = 0;
+        for (log_site * site = _inner::log_site_list(); site; site = site->next)
+        {
+            LONG n = ::InterlockedExchange(&site->suppressed, 0);
+            if (n == 0) continue;
+            log(log_type, czA("%s(%d): %ld lines suppressed", site->file, site->line, n), false);
+            sites++;
+        }
+        return sites;
+    }
+
+    namespace _inner
+    {
+        class log_limit_reporter
+        {
+        public:
+            log_limit_reporter() : m_thread(NULL), m_event(NULL), m_stop(0), m_interval(0), m_type(0)
+            {
+            }
+
+            ~log_limit_reporter()
+            {
+                start(0, 0);
+            }
+
+            bool start(unsigned int interval_ms, unsigned int log_type)
+            {
+                if (m_thread)
+                {
+                    ::InterlockedExchange(&m_stop, 1);
+                    ::SetEvent(m_event);
+                    ::WaitForSingleObject(m_thread, INFINITE);
+                    ::CloseHandle(m_thread);
+                    ::CloseHandle(m_event);
+                    m_thread = NULL;
+                    m_event = NULL;
+                }
+                if (interval_ms == 0) return true;
+
+                m_interval = interval_ms;
+                m_type = log_type;
+                m_stop = 0;
+                m_event = ::CreateEventW(NULL, FALSE, FALSE, NULL);
+                if (!m_event) return false;
+                m_thread = reinterpret_cast<HANDLE>(::_beginthreadex(NULL, 0, &log_limit_reporter::thread_proc, this, 0, NULL));
+                if (!m_thread)
+                {
+                    ::CloseHandle(m_event);
+                    m_event = NULL;
+                    return false;
+                }
+                return true;
+            }
+
+        private:
+            log_limit_reporter(const log_limit_reporter&);
+            log_limit_reporter& operator=(const log_limit_reporter&);
+
+            static unsigned int __stdcall thread_proc(void * param)
+            {
+                log_limit_reporter * self = static_cast<log_limit_reporter *>(param);
+                for (;;)
+                {
+                    ::WaitForSingleObject(self->m_event, self->m_interval);
+                    if (self->m_stop) break;
+                    log_limit_report(self->m_type);
+                }
+                return 0;
+            }
+
+            HANDLE m_thread;
+            HANDLE m_event;
+            volatile LONG m_stop;
+            unsigned int m_interval;
+            unsigned int m_type;
+        };
+    }
+
+    //! calls log_limit_report(\a log_type) every \a interval_ms on a background thread, 0 stops it
+    inline bool log_start_limit_report(unsigned int interval_ms, unsigned int log_type)
+    {
+        static _inner::log_limit_reporter s_reporter;
+        return s_reporter.start(interval_ms, log_type);
+    }
+}
+
+#define TP_LOG_LIMITED_(pass, type, limit, burst, call) \
+    do \
+    { \
+        static tp::log_site tp_log_site_ = { __FILE__, __LINE__, (limit), (burst), 0, 0, 0, 0, NULL }; \
+        if (TP_LOG_TYPE_COMPILED(type) && tp::log_enabled(type) && tp::pass(tp_log_site_)) call; \
+    } while (0)
+
+//! at most \a per_second lines a second, up to \a burst at once
+#define TP_LOG_RATE(type, per_second, burst, text) \
+    TP_LOG_LIMITED_(log_rate_pass, type, per_second, burst, tp::log((type), (text)))
+
+//! one line in \a n
+#define TP_LOG_SAMPLE(type, n, text) \
+    TP_LOG_LIMITED_(log_sample_pass, type, n, 0, tp::log((type), (text)))
+
+//! the first \a k lines
+#define TP_LOG_FIRST(type, k, text) \
+    TP_LOG_LIMITED_(log_first_pass, type, k, 0, tp::log((type), (text)))
+
+#if (_MSC_VER >= 1800)
+#define TP_LOG_RATE_FORMAT(type, per_second, burst, ...) \
+    TP_LOG_LIMITED_(log_rate_pass, type, per_second, burst, tp::log_format((type), __VA_ARGS__))
+
+#define TP_LOG_SAMPLE_FORMAT(type, n, ...) \
+    TP_LOG_LIMITED_(log_sample_pass, type, n, 0, tp::log_format((type), __VA_ARGS__))
+
+#define TP_LOG_FIRST_FORMAT(type, k, ...) \
+    TP_LOG_LIMITED_(log_first_pass, type, k, 0, tp::log_format((type), __VA_ARGS__))
+#endif
@@ -0,0 +1,290 @@
+#pragma once
+
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+#include <share.h>
+#include <string>
+#include "log_index.h"
+
+/** \file log_lz.h
+
+ block compression of log files written by ld_compressed_file. a block is compressed in the
+ LZ4 block format (any LZ4 decoder reads it) and depends on no other block:
+
+   file header              "TPLZ\x01\0\0\0"
+   block: u32 size          bytes of data that follow, bit 31 set if the data is stored as is
+          u32 raw size      bytes after decompression, at most max_raw_size
+          data              never more than the raw size, a block that does not shrink is stored
+
+ the block index is a log_index file ("<file>.idx") with one entry per block: the time of
+ its first line and the file offset of its header, so a time range is found without
+ decompressing anything before it.
+
+ @code
+   tp::log_lz_reader rd;
+   std::string text;
+   if (rd.open(L"app.log.lz")) while (rd.next(text)) { ... }
+ @endcode
+ */
+
+namespace tp
+{
+    struct log_lz_file_header
+    {
+        static const char * magic() { return "TPLZ\x01\0\0\0"; }
+        enum { size = 8 };
+    };
+
+    struct log_lz_block_header
+    {
+        enum { stored = 0x80000000 };
+        //! no block is larger, a size above it is a damaged file
+        enum { max_raw_size = 64 * 1024 * 1024 };
+        unsigned int size;
+        unsigned int raw_size;
+    };
+
+    //! worst case size of \a len compressed bytes
+    inline size_t log_lz_bound(size_t len)
+    {
+        return len + len / 255 + 16;
+    }
+
+    namespace _inner
+    {
+        inline unsigned int log_lz_read32(const unsigned char * p)
+        {
+            unsigned int v;
+            memcpy(&v, p, sizeof(v));
+            return v;
+        }
+
+        inline unsigned char * log_lz_put_length(unsigned char * op, size_t len)
+        {
+            for (; len >= 255; len -= 255) *op++ = 255;
+            *op++ = static_cast<unsigned char>(len);
+            return op;
+        }
+
+        inline unsigned char * log_lz_put_sequence(unsigned char * op, const unsigned char * literals, size_t literal_len,
+            size_t offset, size_t match_len)
+        {
+            unsigned char * token = op++;
+            *token = static_cast<unsigned char>((literal_len >= 15 ? 15 : literal_len) << 4);
+            if (literal_len >= 15) op = log_lz_put_length(op, literal_len - 15);
+            memcpy(op, literals, literal_len);
+            op += literal_len;
+            if (match_len == 0) return op;
+
+            *op++ = static_cast<unsigned char>(offset & 0xFF);
+            *op++ = static_cast<unsigned char>(offset >> 8);
+            match_len -= 4;
+            *token |= static_cast<unsigned char>(match_len >= 15 ? 15 : match_len);
+            if (match_len >= 15) op = log_lz_put_length(op, match_len - 15);
+            return op;
+        }
+    }
+
+    /** compresses \a len bytes into \a dst, which must hold log_lz_bound(len) bytes.
+    * greedy matching with a 4K entry hash table: fast rather than small, log text
+    * still shrinks to about a fifth
+    */
+    inline size_t log_lz_compress(const char * src, size_t len, char * dst)
+    {
+        enum { hash_bits = 12, min_match = 4, last_literals = 5, match_limit = 12, max_offset = 65535 };
+        const unsigned char * base = reinterpret_cast<const unsigned char *>(src);
+        const unsigned char * ip = base;
+        const unsigned char * anchor = base;
+        const unsigned char * end = base + len;
+        unsigned char * op = reinterpret_cast<unsigned char *>(dst);
+
+        if (len > match_limit)
+        {
+            unsigned int table[1 << hash_bits];
+            memset(table, 0, sizeof(table));
+            const unsigned char * search_end = end - match_limit;
+            const unsigned char * match_end = end - last_literals;
+            while (ip < search_end)
+            {
+                unsigned int seq = _inner::log_lz_read32(ip);
+                unsigned int h = (seq * 2654435761u) >> (32 - hash_bits);
+                const unsigned char * ref = base + table[h];
+                table[h] = static_cast<unsigned int>(ip - base);
+                if (ref >= ip || ip - ref > max_offset || _inner::log_lz_read32(ref) != seq)
+                {
+                    ip++;
+                    continue;
+                }
+
+                const unsigned char * m = ip + min_match;
+                const unsigned char * r = ref + min_match;
+                while (m < match_end && *m == *r)
+                {
+                    m++;
+                    r++;
+                }
+                op = _inner::log_lz_put_sequence(op, anchor, static_cast<size_t>(ip - anchor),
+                    static_cast<size_t>(ip - ref), static_cast<size_t>(m - ip));
+                ip = m;
+                anchor = ip;
+            }
+        }
+        op = _inner::log_lz_put_sequence(op, anchor, static_cast<size_t>(end - anchor), 0, 0);
+        return static_cast<size_t>(op - reinterpret_cast<unsigned char *>(dst));
+    }
+
+    //! decompresses a block into \a dst of \a capacity bytes, returns the size or ~0 for corrupt data
+    inline size_t log_lz_decompress(const char * src, size_t len, char * dst, size_t capacity)
+    {
+        const size_t error = ~static_cast<size_t>(0);
+        const unsigned char * ip = reinterpret_cast<const unsigned char *>(src);
+        const unsigned char * iend = ip + len;
+        unsigned char * op = reinterpret_cast<unsigned char *>(dst);
+        unsigned char * ostart = op;
+        unsigned char * oend = op + capacity;
+
+        while (ip < iend)
+        {
+            unsigned int token = *ip++;
+            size_t literal_len = token >> 4;
+            if (literal_len == 15)
+            {
+                unsigned char b;
+                do
+                {
+                    if (ip >= iend) return error;
+                    b = *ip++;
+                    literal_len += b;
+                } while (b == 255);
+            }
+            if (literal_len > static_cast<size_t>(iend - ip) || literal_len > static_cast<size_t>(oend - op)) return error;
+            memcpy(op, ip, literal_len);
+            op += literal_len;
+            ip += literal_len;
+            if (ip >= iend) break;  // the last sequence has no match
+
+            if (iend - ip < 2) return error;
+            size_t offset = ip[0] | (static_cast<size_t>(ip[1]) << 8);
+            ip += 2;
+            if (offset == 0 || offset > static_cast<size_t>(op - ostart)) return error;
+            size_t match_len = token & 15;
+            if (match_len == 15)
+            {
+                unsigned char b;
+                do
+                {
+                    if (ip >= iend) return error;
+                    b = *ip++;
+                    match_len += b;
+                } while (b == 255);
+            }
+            match_len += 4;
+            if (match_len > static_cast<size_t>(oend - op)) return error;
+
+            // byte by byte, a match may overlap the bytes it produces
+            const unsigned char * m = op - offset;
+            while (match_len--) *op++ = *m++;
+        }
+        return static_cast<size_t>(op - ostart);
+    }
+
+    //! reads the blocks of a file written by ld_compressed_file, in order or by offset
+    class log_lz_reader
+    {
+    public:
+        log_lz_reader() : m_fp(NULL), m_file_size(0)
+        {
+        }
+
+        ~log_lz_reader()
+        {
+            close();
+        }
+
+        bool open(const wchar_t * filename)
+        {
+            close();
+            m_fp = _wfsopen(filename, L"rb", _SH_DENYNO);
+            if (!m_fp) return false;
+            _fseeki64(m_fp, 0, SEEK_END);
+            __int64 file_size = _ftelli64(m_fp);
+            m_file_size = file_size > 0 ? static_cast<unsigned __int64>(file_size) : 0;
+            _fseeki64(m_fp, 0, SEEK_SET);
+            char header[log_lz_file_header::size];
+            if (fread(header, 1, sizeof(header), m_fp) != sizeof(header) || memcmp(header, log_lz_file_header::magic(), sizeof(header)) != 0)
+            {
+                close();
+                return false;
+            }
+            return true;
+        }
+
+        void close()
+        {
+            if (m_fp)
+            {
+                fclose(m_fp);
+                m_fp = NULL;
+            }
+        }
+
+        //! the text of the next block, false at the end of the file or at a truncated or damaged block
+        bool next(std::string& text)
+        {
+            text.clear();
+            if (!m_fp) return false;
+            log_lz_block_header bh;
+            if (fread(&bh, 1, sizeof(bh), m_fp) != sizeof(bh)) return false;
+            size_t size = bh.size & ~static_cast<unsigned int>(log_lz_block_header::stored);
+            __int64 pos = _ftelli64(m_fp);
+            if (bh.raw_size > log_lz_block_header::max_raw_size || size > bh.raw_size
+                || pos < 0 || size > m_file_size - static_cast<unsigned __int64>(pos)) return false;
+            m_buf.resize(size);
+            if (size > 0 && fread(&m_buf[0], 1, size, m_fp) != size) return false;
+            if (bh.raw_size == 0) return true;
+
+            if (bh.size & log_lz_block_header::stored)
+            {
+                text = m_buf;
+                return text.length() == bh.raw_size;
+            }
+            text.resize(bh.raw_size);
+            return log_lz_decompress(m_buf.c_str(), size, &text[0], text.length()) == bh.raw_size;
+        }
+
+        //! the text of the block at \a offset, an offset from the block index
+        bool read_block(unsigned __int64 offset, std::string& text)
+        {
+            text.clear();
+            if (!m_fp || _fseeki64(m_fp, static_cast<__int64>(offset), SEEK_SET) != 0) return false;
+            return next(text);
+        }
+
+    private:
+        log_lz_reader(const log_lz_reader&);
+        log_lz_reader& operator=(const log_lz_reader&);
+
+        FILE * m_fp;
+        unsigned __int64 m_file_size;
+        std::string m_buf;
+    };
+
+    //! decompresses a file written by ld_compressed_file to a plain log file, returns the bytes written
+    inline unsigned __int64 log_lz_convert(const wchar_t * lz_file, const wchar_t * out_file)
+    {
+        log_lz_reader rd;
+        if (!rd.open(lz_file)) return 0;
+        FILE * out = _wfsopen(out_file, L"wb", _SH_DENYWR);
+        if (!out) return 0;
+
+        unsigned __int64 n = 0;
+        std::string text;
+        while (rd.next(text))
+        {
+            n += fwrite(text.c_str(), 1, text.length(), out);
+        }
+        fclose(out);
+        return n;
+    }
+}
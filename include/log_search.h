@@ -0,0 +1,391 @@
+#pragma once
+
+#include <windows.h>
+#include <process.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#if (_MSC_VER >= 1700)
+#include <regex>
+#endif
+#include "log_index.h"
+
+/** \file log_search.h
+
+ searches UTF-8 log files written by the tplib file devices, in parallel: the files are
+ memory mapped in chunks that end at line boundaries and the chunks are scanned by one
+ thread per core. a line matches when it passes every condition of the query.
+
+ the prefix of a line is cut into fields by a layout that follows the device's context list,
+ so fields like the type or the tid can be compared without parsing the line in general:
+ @code
+   // contexts: lc_time(L"%Y-%m-%d %H:%M:%S"), lc_type(L"DIWE"), lc_tid, lc_text(L" ")
+   tp::log_search_query q;
+   q.layout.add(tp::LCID_TIME, 19).add(tp::LCID_TYPE, '|').add(tp::LCID_TID, ' ');
+   q.where(tp::LCID_TYPE, "E|").between(tp::LCID_TIME, "2026-10-16 10:30:00", "2026-10-16 10:35:00");
+   q.text = "timeout";
+   std::vector<tp::log_search_match> found;
+   tp::log_search(files, q, found);
+ @endcode
+ */
+
+namespace tp
+{
+    //! how the contexts of a device split the start of a line into fields
+    class log_search_layout
+    {
+    public:
+        struct field
+        {
+            int context_id;
+            size_t width;       // fixed width, or 0 to end at terminator
+            char terminator;    // part of the field, like the '|' of lc_type
+        };
+
+        //! a field that ends with (and includes) \a terminator
+        log_search_layout& add(int context_id, char terminator)
+        {
+            field f = { context_id, 0, terminator };
+            m_fields.push_back(f);
+            return *this;
+        }
+
+        //! a field of \a width bytes, e.g. a time
+        log_search_layout& add(int context_id, size_t width)
+        {
+            field f = { context_id, width, 0 };
+            m_fields.push_back(f);
+            return *this;
+        }
+
+        //! a field of \a width bytes followed by a separator that is skipped
+        log_search_layout& add(int context_id, size_t width, char separator)
+        {
+            field f = { context_id, width, separator };
+            m_fields.push_back(f);
+            return *this;
+        }
+
+        /** finds the field of \a context_id in the line [p, end), false if the line is too short.
+        * the rest of the line after the last field is the text
+        */
+        bool locate(int context_id, const char * p, const char * end, const char *& begin, size_t& len) const
+        {
+            for (size_t i = 0; i < m_fields.size(); i++)
+            {
+                const field& f = m_fields[i];
+                const char * q;
+                if (f.width > 0)
+                {
+                    if (static_cast<size_t>(end - p) < f.width) return false;
+                    q = p + f.width;
+                }
+                else
+                {
+                    q = static_cast<const char *>(memchr(p, f.terminator, static_cast<size_t>(end - p)));
+                    if (!q) return false;
+                    q++;
+                }
+                if (f.context_id == context_id)
+                {
+                    begin = p;
+                    len = static_cast<size_t>(q - p);
+                    return true;
+                }
+                p = q;
+                if (f.width > 0 && f.terminator)
+                {
+                    if (p >= end || *p != f.terminator) return false;
+                    p++;
+                }
+            }
+            return false;
+        }
+
+    private:
+        std::vector<field> m_fields;
+    };
+
+    //! what log_search looks for, all conditions that are set must hold
+    struct log_search_query
+    {
+        struct field_range
+        {
+            int context_id;
+            std::string from;   // inclusive, compared as bytes
+            std::string to;     // inclusive, empty for no upper bound
+        };
+
+        std::string text;                   // substring of the line, empty for any
+#if (_MSC_VER >= 1700)
+        std::string regex;                  // ECMAScript regex searched in the line, empty for none
+#endif
+        log_search_layout layout;
+        std::vector<field_range> fields;
+        unsigned __int64 time_from;         // FILETIME range looked up in the log_index, 0 for none
+        unsigned __int64 time_to;
+
+        log_search_query() : time_from(0), time_to(0)
+        {
+        }
+
+        //! the field of \a context_id equals \a value
+        log_search_query& where(int context_id, const std::string& value)
+        {
+            return between(context_id, value, value);
+        }
+
+        //! \a from <= the field of \a context_id <= \a to, fixed width fields like times compare well
+        log_search_query& between(int context_id, const std::string& from, const std::string& to)
+        {
+            field_range r;
+            r.context_id = context_id;
+            r.from = from;
+            r.to = to;
+            fields.push_back(r);
+            return *this;
+        }
+    };
+
+    struct log_search_match
+    {
+        size_t file;                // index in the file list
+        unsigned __int64 offset;    // of the line in the file
+        std::string line;           // without the line break
+    };
+
+    namespace _inner
+    {
+        class log_searcher
+        {
+        public:
+            enum
+            {
+                chunk_size = 16 * 1024 * 1024,
+                max_line = 1024 * 1024,     // longer lines are cut at a chunk end
+            };
+
+            log_searcher(const std::vector<std::wstring>& files, const log_search_query& query)
+                : m_files(files), m_query(query), m_next_task(0)
+            {
+#if (_MSC_VER >= 1700)
+                m_has_regex = !query.regex.empty();
+                if (m_has_regex) m_regex.assign(query.regex);
+#endif
+                SYSTEM_INFO si;
+                ::GetSystemInfo(&si);
+                m_granularity = si.dwAllocationGranularity;
+                m_cores = si.dwNumberOfProcessors > 0 ? si.dwNumberOfProcessors : 1;
+            }
+
+            ~log_searcher()
+            {
+                for (size_t i = 0; i < m_maps.size(); i++)
+                {
+                    ::CloseHandle(m_maps[i].mapping);
+                    ::CloseHandle(m_maps[i].file);
+                }
+            }
+
+            void run(std::vector<log_search_match>& out, size_t threads)
+            {
+                make_tasks();
+                if (threads == 0) threads = m_cores;
+                if (threads > m_tasks.size()) threads = m_tasks.size();
+
+                std::vector<HANDLE> handles;
+                for (size_t i = 1; i < threads; i++)
+                {
+                    HANDLE h = reinterpret_cast<HANDLE>(::_beginthreadex(NULL, 0, &log_searcher::thread_proc, this, 0, NULL));
+                    if (h) handles.push_back(h);
+                }
+                work();
+                if (!handles.empty())
+                {
+                    ::WaitForMultipleObjects(static_cast<DWORD>(handles.size()), &handles[0], TRUE, INFINITE);
+                    for (size_t i = 0; i < handles.size(); i++) ::CloseHandle(handles[i]);
+                }
+
+                // tasks are in file and offset order
+                out.clear();
+                for (size_t i = 0; i < m_tasks.size(); i++)
+                {
+                    out.insert(out.end(), m_tasks[i].matches.begin(), m_tasks[i].matches.end());
+                }
+            }
+
+        private:
+            log_searcher& operator=(const log_searcher&);
+
+            struct task
+            {
+                size_t file;
+                HANDLE mapping;
+                unsigned __int64 file_size;
+                unsigned __int64 begin;     // lines starting in [begin, end) belong to the task
+                unsigned __int64 end;
+                std::vector<log_search_match> matches;
+            };
+
+            struct file_map
+            {
+                HANDLE file;
+                HANDLE mapping;
+            };
+
+            void make_tasks()
+            {
+                for (size_t f = 0; f < m_files.size(); f++)
+                {
+                    file_map fm;
+                    fm.file = ::CreateFileW(m_files[f].c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+                    if (fm.file == INVALID_HANDLE_VALUE) continue;
+                    LARGE_INTEGER size;
+                    fm.mapping = NULL;
+                    if (::GetFileSizeEx(fm.file, &size) && size.QuadPart > 0)
+                    {
+                        fm.mapping = ::CreateFileMappingW(fm.file, NULL, PAGE_READONLY, 0, 0, NULL);
+                    }
+                    if (!fm.mapping)
+                    {
+                        ::CloseHandle(fm.file);
+                        continue;
+                    }
+                    m_maps.push_back(fm);
+
+                    unsigned __int64 file_size = static_cast<unsigned __int64>(size.QuadPart);
+                    unsigned __int64 begin = 0;
+                    unsigned __int64 end = file_size;
+                    if (m_query.time_from || m_query.time_to)
+                    {
+                        log_index idx;
+                        if (idx.load(m_files[f].c_str()) && idx.size() > 0)
+                        {
+                            if (m_query.time_from) begin = idx.find(m_query.time_from);
+                            if (m_query.time_to) end = (std::min)(end, idx.find_end(m_query.time_to));
+                        }
+                    }
+
+                    for (unsigned __int64 pos = begin; pos < end; pos += chunk_size)
+                    {
+                        task t;
+                        t.file = f;
+                        t.mapping = fm.mapping;
+                        t.file_size = file_size;
+                        t.begin = pos;
+                        t.end = (std::min)(end, pos + chunk_size);
+                        m_tasks.push_back(t);
+                    }
+                }
+            }
+
+            static unsigned int __stdcall thread_proc(void * param)
+            {
+                static_cast<log_searcher *>(param)->work();
+                return 0;
+            }
+
+            void work()
+            {
+                for (;;)
+                {
+                    size_t i = static_cast<size_t>(::InterlockedIncrement(&m_next_task) - 1);
+                    if (i >= m_tasks.size()) break;
+                    scan(m_tasks[i]);
+                }
+            }
+
+            void scan(task& t)
+            {
+                // map from one byte before the chunk (to see if it starts a line) to max_line after it
+                unsigned __int64 view_begin = t.begin > 0 ? t.begin - 1 : 0;
+                view_begin -= view_begin % m_granularity;
+                unsigned __int64 view_end = (std::min)(t.file_size, t.end + max_line);
+                size_t view_len = static_cast<size_t>(view_end - view_begin);
+                const char * view = static_cast<const char *>(::MapViewOfFile(t.mapping, FILE_MAP_READ,
+                    static_cast<DWORD>(view_begin >> 32), static_cast<DWORD>(view_begin & 0xFFFFFFFF), view_len));
+                if (!view) return;
+
+                const char * end = view + view_len;
+                const char * chunk_end = view + static_cast<size_t>(t.end - view_begin);
+                const char * p = view + static_cast<size_t>(t.begin - view_begin);
+                if (t.begin > 0 && p[-1] != '\n')
+                {
+                    // the line started in the previous chunk
+                    p = static_cast<const char *>(memchr(p, '\n', static_cast<size_t>(end - p)));
+                    p = p ? p + 1 : end;
+                }
+
+                while (p < chunk_end)
+                {
+                    const char * eol = static_cast<const char *>(memchr(p, '\n', static_cast<size_t>(end - p)));
+                    const char * line_end = eol ? eol : end;
+                    const char * text_end = (line_end > p && line_end[-1] == '\r') ? line_end - 1 : line_end;
+                    if (matches(p, text_end))
+                    {
+                        log_search_match m;
+                        m.file = t.file;
+                        m.offset = view_begin + static_cast<unsigned __int64>(p - view);
+                        m.line.assign(p, text_end);
+                        t.matches.push_back(m);
+                    }
+                    p = line_end + 1;
+                }
+                ::UnmapViewOfFile(view);
+            }
+
+            bool matches(const char * p, const char * end) const
+            {
+                for (size_t i = 0; i < m_query.fields.size(); i++)
+                {
+                    const log_search_query::field_range& r = m_query.fields[i];
+                    const char * field;
+                    size_t len;
+                    if (!m_query.layout.locate(r.context_id, p, end, field, len)) return false;
+                    if (compare(field, len, r.from) < 0) return false;
+                    if (!r.to.empty() && compare(field, len, r.to) > 0) return false;
+                }
+                if (!m_query.text.empty())
+                {
+                    if (std::search(p, end, m_query.text.begin(), m_query.text.end()) == end) return false;
+                }
+#if (_MSC_VER >= 1700)
+                if (m_has_regex && !std::regex_search(p, end, m_regex)) return false;
+#endif
+                return true;
+            }
+
+            static int compare(const char * field, size_t len, const std::string& value)
+            {
+                size_t n = (std::min)(len, value.length());
+                int c = memcmp(field, value.c_str(), n);
+                if (c != 0) return c;
+                return len < value.length() ? -1 : (len > value.length() ? 1 : 0);
+            }
+
+        private:
+            const std::vector<std::wstring>& m_files;
+            const log_search_query& m_query;
+#if (_MSC_VER >= 1700)
+            bool m_has_regex;
+            std::regex m_regex;
+#endif
+            std::vector<file_map> m_maps;
+            std::vector<task> m_tasks;
+            volatile LONG m_next_task;
+            unsigned __int64 m_granularity;
+            size_t m_cores;
+        };
+    }
+
+    /** finds the lines of \a files that match \a query, in file and line order.
+    * \a threads 0 uses one thread per core
+    */
+    inline void log_search(const std::vector<std::wstring>& files, const log_search_query& query,
+        std::vector<log_search_match>& out, size_t threads = 0)
+    {
+        _inner::log_searcher searcher(files, query);
+        searcher.run(out, threads);
+    }
+}
@@ -0,0 +1,249 @@
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <vector>
+#include "oss.h"
+#include "format_shim.h"
+
+/** \file log_stats.h
+
+ runtime statistics of the logger: lines and bytes per log type, per device counters,
+ enqueue and device write latency histograms. collecting is off by default, see
+ logger::enable_stats. hot counters are kept per thread and only summed up when
+ somebody asks for them.
+ */
+
+namespace tp
+{
+    //! latency histogram with power of 2 buckets: bucket i counts [2^i, 2^(i+1)) nanoseconds
+    struct log_histogram
+    {
+        enum { buckets = 40 };
+        unsigned __int64 counts[buckets];
+
+        log_histogram()
+        {
+            clear();
+        }
+
+        void clear()
+        {
+            for (size_t i = 0; i < buckets; i++) counts[i] = 0;
+        }
+
+        void add(unsigned __int64 ns)
+        {
+            size_t i = 0;
+            if (ns >> 32) { i += 32; ns >>= 32; }
+            if (ns >> 16) { i += 16; ns >>= 16; }
+            if (ns >> 8) { i += 8; ns >>= 8; }
+            if (ns >> 4) { i += 4; ns >>= 4; }
+            if (ns >> 2) { i += 2; ns >>= 2; }
+            if (ns >> 1) { i += 1; }
+            counts[i < buckets ? i : buckets - 1]++;
+        }
+
+        void merge(const log_histogram& other)
+        {
+            for (size_t i = 0; i < buckets; i++) counts[i] += other.counts[i];
+        }
+
+        unsigned __int64 count() const
+        {
+            unsigned __int64 n = 0;
+            for (size_t i = 0; i < buckets; i++) n += counts[i];
+            return n;
+        }
+
+        //! upper bound in nanoseconds of the bucket holding the p-th percentile (0 < p <= 100)
+        unsigned __int64 percentile(double p) const
+        {
+            unsigned __int64 total = count();
+            if (total == 0) return 0;
+            unsigned __int64 rank = static_cast<unsigned __int64>(total * p / 100.0 + 0.5);
+            if (rank < 1) rank = 1;
+            unsigned __int64 n = 0;
+            for (size_t i = 0; i < buckets; i++)
+            {
+                n += counts[i];
+                if (n >= rank) return (static_cast<unsigned __int64>(1) << (i + 1)) - 1;
+            }
+            return (static_cast<unsigned __int64>(1) << buckets) - 1;
+        }
+    };
+
+    //! statistics of one device
+    struct log_device_stats
+    {
+        const void * device;
+        unsigned __int64 writes;        // writev calls
+        unsigned __int64 lines;
+        unsigned __int64 bytes;
+        long dropped;                   // see log_device::dropped
+        size_t pending;                 // see log_device::pending
+        log_histogram write_latency;
+
+        log_device_stats() : device(NULL), writes(0), lines(0), bytes(0), dropped(0), pending(0)
+        {
+        }
+    };
+
+    //! what logger::get_stats returns, all counters are totals since enable_stats
+    struct log_stats
+    {
+        enum { max_types = 32 };
+        unsigned __int64 lines[max_types];
+        unsigned __int64 bytes[max_types];
+        log_histogram enqueue_latency;  // time spent in log() by the calling threads
+        size_t queue_depth;             // records waiting for the async consumer
+        std::vector<log_device_stats> devices;
+
+        log_stats() : queue_depth(0)
+        {
+            for (size_t i = 0; i < max_types; i++) lines[i] = bytes[i] = 0;
+        }
+
+        unsigned __int64 total_lines() const
+        {
+            unsigned __int64 n = 0;
+            for (size_t i = 0; i < max_types; i++) n += lines[i];
+            return n;
+        }
+
+        unsigned __int64 total_bytes() const
+        {
+            unsigned __int64 n = 0;
+            for (size_t i = 0; i < max_types; i++) n += bytes[i];
+            return n;
+        }
+
+        //! one line summary, latencies in microseconds
+        std::string to_string() const
+        {
+            std::string s = static_cast<const char *>(cfmt<char, 256>("log stats: lines %llu, bytes %llu, queue %u, enqueue p50 %.1fus p99 %.1fus",
+                total_lines(), total_bytes(), static_cast<unsigned int>(queue_depth),
+                enqueue_latency.percentile(50) / 1000.0, enqueue_latency.percentile(99) / 1000.0));
+            for (size_t i = 0; i < devices.size(); i++)
+            {
+                const log_device_stats& d = devices[i];
+                s += static_cast<const char *>(cfmt<char, 256>("; device %u: lines %llu, bytes %llu, write p50 %.1fus p99 %.1fus, dropped %ld, pending %u",
+                    static_cast<unsigned int>(i), d.lines, d.bytes,
+                    d.write_latency.percentile(50) / 1000.0, d.write_latency.percentile(99) / 1000.0,
+                    d.dropped, static_cast<unsigned int>(d.pending)));
+            }
+            return s;
+        }
+    };
+
+    namespace _inner
+    {
+        //! QueryPerformanceCounter ticks to nanoseconds
+        inline unsigned __int64 log_ticks_to_ns(LONGLONG ticks)
+        {
+            static LONGLONG s_freq = 0;
+            if (s_freq == 0)
+            {
+                LARGE_INTEGER f;
+                ::QueryPerformanceFrequency(&f);
+                s_freq = f.QuadPart;
+            }
+            if (ticks <= 0) return 0;
+            return static_cast<unsigned __int64>(ticks / s_freq * 1000000000 + ticks % s_freq * 1000000000 / s_freq);
+        }
+
+        inline LONGLONG log_ticks()
+        {
+            LARGE_INTEGER now;
+            ::QueryPerformanceCounter(&now);
+            return now.QuadPart;
+        }
+
+        /** per thread counters: each thread only writes its own block, no interlocked operations.
+        * the blocks are chained in a lock-free list and stay until the registry is destroyed,
+        * so the counts of finished threads are kept
+        */
+        class log_thread_counters
+        {
+        public:
+            struct block
+            {
+                log_histogram enqueue_latency;
+                unsigned __int64 lines[log_stats::max_types];   // written by this thread
+                unsigned __int64 bytes[log_stats::max_types];
+                block * next;
+
+                block() : next(NULL)
+                {
+                    clear();
+                }
+
+                void clear()
+                {
+                    enqueue_latency.clear();
+                    for (size_t i = 0; i < log_stats::max_types; i++) lines[i] = bytes[i] = 0;
+                }
+            };
+
+            log_thread_counters() : m_head(NULL)
+            {
+            }
+
+            ~log_thread_counters()
+            {
+                while (m_head)
+                {
+                    block * b = m_head;
+                    m_head = b->next;
+                    delete b;
+                }
+            }
+
+            block& local()
+            {
+                block * b = static_cast<block *>(m_tls.get());
+                if (!b)
+                {
+                    b = new block;
+                    block * head;
+                    do
+                    {
+                        head = m_head;
+                        b->next = head;
+                    } while (::InterlockedCompareExchangePointer(reinterpret_cast<void * volatile *>(&m_head), b, head) != head);
+                    m_tls.set(b);
+                }
+                return *b;
+            }
+
+            //! sums up the blocks of all threads, the values are approximate while threads log
+            void sum(log_stats& stats) const
+            {
+                for (const block * b = m_head; b; b = b->next)
+                {
+                    stats.enqueue_latency.merge(b->enqueue_latency);
+                    for (size_t i = 0; i < log_stats::max_types; i++)
+                    {
+                        stats.lines[i] += b->lines[i];
+                        stats.bytes[i] += b->bytes[i];
+                    }
+                }
+            }
+
+            void clear()
+            {
+                for (block * b = m_head; b; b = b->next)
+                {
+                    b->clear();
+                }
+            }
+
+        private:
+            log_thread_counters(const log_thread_counters&);
+            log_thread_counters& operator=(const log_thread_counters&);
+
+            os::tls_value m_tls;
+            block * volatile m_head;
+        };
+    }
+}
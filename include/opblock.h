@@ -70,6 +70,38 @@ namespace tp
             return lstr;
         }
 
+        //! get_oplist() into a caller buffer for a crash handler: allocates nothing and never
+        //! waits, an empty list comes back when the map lock is held by anyone
+        size_t format_oplist(wchar_t* buf, size_t len, const wchar_t* sep) const
+        {
+            if (len == 0) return 0;
+            size_t n = 0;
+
+            const oplist* lst = 0;
+            if (!m_lock.held_by_caller() && m_lock.try_lock())
+            {
+                opmap_t::const_iterator it = m_obmap.find(os::current_tid());
+                if (it != m_obmap.end()) lst = it->second;
+                m_lock.unlock();
+            }
+            if (lst)
+            {
+                for (strlist_t::const_iterator it = lst->lst.begin(); it != lst->lst.end(); ++it)
+                {
+                    if (n > 0) append(buf, len, n, sep);
+                    append(buf, len, n, it->c_str());
+                }
+                if (!lst->op.empty())
+                {
+                    if (n > 0) append(buf, len, n, sep);
+                    append(buf, len, n, lst->op.c_str());
+                }
+            }
+
+            buf[n] = 0;
+            return n;
+        }
+
         static size_t get_create_dependencies(sid_t* , size_t )
         {
             return 0;
@@ -108,6 +140,11 @@ namespace tp
             return 0;
         }
 
+        static void append(wchar_t* buf, size_t len, size_t& n, const wchar_t* s)
+        {
+            while (*s && n + 1 < len) buf[n++] = *s++;
+        }
+
         void free()
         {
             for (opmap_t::const_iterator it = m_obmap.begin(); it != m_obmap.end(); ++it)
@@ -0,0 +1,217 @@
+﻿// throughput and call latency of tp::log for combinations of devices, contexts, sync/async
+// mode and producer threads. one result per line on stdout, as CSV or JSON lines:
+//   tplibbench.exe --threads=8 --lines=200000 --format=json > before.json
+
+#include <windows.h>
+#include <process.h>
+#include <stdio.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include <tplib.h>
+#include <cmdlineparser.h>
+#include <log_device.h>
+#include <log_context.h>
+
+namespace
+{
+    const char * const s_text = "benchmark line with a payload of some length 0123456789";
+
+    //! counts and forgets, the cost of the logger alone
+    class ld_null : public tp::log_device
+    {
+    public:
+        virtual bool open() { return true; }
+        virtual bool close() { return true; }
+        virtual bool flush() { return true; }
+
+        using tp::log_device::write;
+        virtual size_t write(const char *, size_t len, int)
+        {
+            return len;
+        }
+
+        virtual size_t writev(const tp::log_segment * segs, size_t count)
+        {
+            size_t n = 0;
+            for (size_t i = 0; i < count; i++) n += segs[i].len;
+            return n;
+        }
+    };
+
+    struct scenario
+    {
+        const char * device;
+        const char * contexts;
+        bool async;
+        int threads;
+        int lines;
+    };
+
+    struct result
+    {
+        double seconds;
+        double lines_per_sec;
+        unsigned __int64 p50;
+        unsigned __int64 p99;
+        unsigned __int64 p999;
+    };
+
+    struct producer
+    {
+        HANDLE start;
+        int lines;
+        std::vector<LONGLONG> ticks;
+    };
+
+    unsigned int __stdcall producer_proc(void * param)
+    {
+        producer * p = static_cast<producer *>(param);
+        p->ticks.resize(static_cast<size_t>(p->lines));
+        ::WaitForSingleObject(p->start, INFINITE);
+        for (int i = 0; i < p->lines; i++)
+        {
+            LONGLONG t0 = tp::_inner::log_ticks();
+            tp::log(1, s_text, false);
+            p->ticks[static_cast<size_t>(i)] = tp::_inner::log_ticks() - t0;
+        }
+        return 0;
+    }
+
+    tp::log_device * make_device(const std::string& name)
+    {
+        if (name == "mem") return new tp::ld_mem_log;
+        if (name == "file") return new tp::ld_file(L"tplibbench.log");
+        return new ld_null;
+    }
+
+    void add_contexts(tp::log_device * ld, const std::string& contexts)
+    {
+        if (contexts.find("time") != std::string::npos) tp::log_add_context(ld, new tp::lc_time(L"%H:%M:%S", true));
+        if (contexts.find("tid") != std::string::npos) tp::log_add_context(ld, new tp::lc_tid);
+        if (contexts.find("type") != std::string::npos) tp::log_add_context(ld, new tp::lc_type(L"DIWE"));
+        if (contexts.find("indent") != std::string::npos) tp::log_add_context(ld, new tp::lc_indent);
+        if (!contexts.empty()) tp::log_add_context(ld, new tp::lc_text(L" "));
+    }
+
+    unsigned __int64 percentile(const std::vector<LONGLONG>& sorted, double p)
+    {
+        if (sorted.empty()) return 0;
+        size_t i = static_cast<size_t>(p / 100.0 * static_cast<double>(sorted.size() - 1) + 0.5);
+        return tp::_inner::log_ticks_to_ns(sorted[i]);
+    }
+
+    result run(const scenario& s)
+    {
+        tp::log_device * ld = make_device(s.device);
+        tp::log_add_device(ld, 0xFFFFFFFF, false);
+        add_contexts(ld, s.contexts);
+        if (s.async) tp::log_start_async(64 * 1024);
+
+        HANDLE start = ::CreateEventW(NULL, TRUE, FALSE, NULL);
+        std::vector<producer> producers(static_cast<size_t>(s.threads));
+        std::vector<HANDLE> handles;
+        for (size_t i = 0; i < producers.size(); i++)
+        {
+            producers[i].start = start;
+            producers[i].lines = s.lines;
+            handles.push_back(reinterpret_cast<HANDLE>(::_beginthreadex(NULL, 0, &producer_proc, &producers[i], 0, NULL)));
+        }
+        ::Sleep(50);
+
+        LONGLONG t0 = tp::_inner::log_ticks();
+        ::SetEvent(start);
+        ::WaitForMultipleObjects(static_cast<DWORD>(handles.size()), &handles[0], TRUE, INFINITE);
+        // throughput counts until the devices have every line
+        if (s.async) tp::tplogger::instance().wait_async_idle();
+        LONGLONG elapsed = tp::_inner::log_ticks() - t0;
+
+        for (size_t i = 0; i < handles.size(); i++) ::CloseHandle(handles[i]);
+        ::CloseHandle(start);
+        if (s.async) tp::log_stop_async();
+        tp::log_remove_device(ld);
+        delete ld;
+        ::DeleteFileW(L"tplibbench.log");
+
+        std::vector<LONGLONG> ticks;
+        for (size_t i = 0; i < producers.size(); i++)
+        {
+            ticks.insert(ticks.end(), producers[i].ticks.begin(), producers[i].ticks.end());
+        }
+        std::sort(ticks.begin(), ticks.end());
+
+        result r;
+        r.seconds = static_cast<double>(tp::_inner::log_ticks_to_ns(elapsed)) / 1e9;
+        r.lines_per_sec = r.seconds > 0 ? static_cast<double>(ticks.size()) / r.seconds : 0;
+        r.p50 = percentile(ticks, 50);
+        r.p99 = percentile(ticks, 99);
+        r.p999 = percentile(ticks, 99.9);
+        return r;
+    }
+
+    void print(const scenario& s, const result& r, bool json)
+    {
+        if (json)
+        {
+            printf("{\"mode\":\"%s\",\"device\":\"%s\",\"contexts\":\"%s\",\"threads\":%d,\"lines\":%d,"
+                "\"seconds\":%.6f,\"lines_per_sec\":%.0f,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu}\n",
+                s.async ? "async" : "sync", s.device, s.contexts, s.threads, s.lines * s.threads,
+                r.seconds, r.lines_per_sec, r.p50, r.p99, r.p999);
+        }
+        else
+        {
+            printf("%s,%s,%s,%d,%d,%.6f,%.0f,%llu,%llu,%llu\n",
+                s.async ? "async" : "sync", s.device, s.contexts, s.threads, s.lines * s.threads,
+                r.seconds, r.lines_per_sec, r.p50, r.p99, r.p999);
+        }
+        fflush(stdout);
+    }
+}
+
+int wmain(int argc, wchar_t * argv[])
+{
+    tp::helper::register_tp_global_services();
+
+    int max_threads = 4;
+    int lines = 200000;
+    std::wstring format = L"csv";
+    std::wstring mode = L"both";
+    tp::cmdline_parser parser;
+    parser.register_int_option(L"t", L"threads", &max_threads);
+    parser.register_int_option(L"n", L"lines", &lines);
+    parser.register_string_option(L"f", L"format", &format);
+    parser.register_string_option(L"m", L"mode", &mode);
+    try
+    {
+        parser.parse(static_cast<size_t>(argc), argv);
+    }
+    catch (tp::cmdline_parser::parse_error& e)
+    {
+        fwprintf(stderr, L"%s\nusage: tplibbench [--threads=N] [--lines=N per thread] [--format=csv|json] [--mode=sync|async|both]\n", e.message.c_str());
+        return 1;
+    }
+
+    const bool json = (format == L"json");
+    if (!json) printf("mode,device,contexts,threads,lines,seconds,lines_per_sec,p50_ns,p99_ns,p999_ns\n");
+
+    const char * devices[] = { "null", "mem", "file" };
+    const char * contexts[] = { "", "time", "time+tid+type", "time+tid+type+indent" };
+    for (int m = 0; m < 2; m++)
+    {
+        bool async = (m == 1);
+        if ((async && mode == L"sync") || (!async && mode == L"async")) continue;
+        for (size_t d = 0; d < sizeof(devices)/sizeof(devices[0]); d++)
+        {
+            for (size_t c = 0; c < sizeof(contexts)/sizeof(contexts[0]); c++)
+            {
+                for (int threads = 1; threads <= max_threads; threads = (threads * 2 > max_threads && threads < max_threads) ? max_threads : threads * 2)
+                {
+                    scenario s = { devices[d], contexts[c], async, threads, lines };
+                    print(s, run(s), json);
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -8,6 +8,7 @@
 #include "test_cmdlineparser.h"
 #include "test_service.h"
 #include "test_algorithm.h"
+#include "test_log.h"
 #include <util_win.h>
 
 #include <vector>
@@ -0,0 +1,864 @@
+#pragma once
+
+#include <format_shim.h>
+#include <log_device.h>
+#include <log_context.h>
+#include <log_search.h>
+#include <log_limit.h>
+#include <log_crash.h>
+#include <unittest.h>
+#include <process.h>
+
+//! ld_mem_log whose writes wait while the gate is closed, stands in for a stalled device
+class test_gated_log : public tp::ld_mem_log
+{
+public:
+    test_gated_log() : m_gate(::CreateEventW(NULL, TRUE, TRUE, NULL)), m_writes(0), m_flushes(0)
+    {
+    }
+    ~test_gated_log()
+    {
+        ::CloseHandle(m_gate);
+    }
+    void close_gate() { ::ResetEvent(m_gate); }
+    void open_gate() { ::SetEvent(m_gate); }
+    long writes() const { return m_writes; }
+    long flushes() const { return m_flushes; }
+
+    using tp::ld_mem_log::write;
+    virtual size_t writev(const tp::log_segment * segs, size_t count)
+    {
+        ::InterlockedIncrement(&m_writes);
+        ::WaitForSingleObject(m_gate, INFINITE);
+        return tp::ld_mem_log::writev(segs, count);
+    }
+    virtual bool flush()
+    {
+        ::InterlockedIncrement(&m_flushes);
+        return true;
+    }
+private:
+    HANDLE m_gate;
+    volatile LONG m_writes;
+    volatile LONG m_flushes;
+};
+
+//! the whole file, empty if it does not exist
+inline std::string test_read_file(const wchar_t * filename)
+{
+    std::string text;
+    FILE * fp = _wfsopen(filename, L"rb", _SH_DENYNO);
+    if (fp)
+    {
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) text.append(buf, n);
+        fclose(fp);
+    }
+    return text;
+}
+
+//! ld_mem_log that counts the flush() and sync() calls it gets
+class test_flush_log : public tp::ld_mem_log
+{
+public:
+    test_flush_log() : m_flushes(0), m_syncs(0)
+    {
+    }
+    long flushes() const { return m_flushes; }
+    long syncs() const { return m_syncs; }
+
+    virtual bool flush()
+    {
+        ::InterlockedIncrement(&m_flushes);
+        return true;
+    }
+    virtual bool sync()
+    {
+        ::InterlockedIncrement(&m_syncs);
+        return true;
+    }
+private:
+    volatile LONG m_flushes;
+    volatile LONG m_syncs;
+};
+
+//! lc_hrtime whose performance counter can be made to run ahead of the system clock
+class test_hrtime : public tp::lc_hrtime
+{
+public:
+    void run_ahead(unsigned __int64 ns) { m_base_ns += ns; }
+    void recalibrate() { calibrate(); }
+    using tp::lc_hrtime::now;
+};
+
+//! exposes the rotated file list and the file lock
+class test_rotating_file : public tp::ld_rotating_file
+{
+public:
+    test_rotating_file(const wchar_t * filename, unsigned __int64 max_size, unsigned int keep)
+        : tp::ld_rotating_file(filename, max_size, 0, keep, false)
+    {
+    }
+    using tp::ld_rotating_file::rotated_files;
+    tp::critical_section_lock& file_lock() { return m_file_lock; }
+};
+
+//! exposes the rotated file list
+class test_compressed_file : public tp::ld_compressed_file
+{
+public:
+    test_compressed_file(const wchar_t * filename, unsigned __int64 max_size)
+        : tp::ld_compressed_file(filename, max_size, 0, 0, 4096)
+    {
+    }
+    using tp::ld_compressed_file::rotated_files;
+};
+
+//! ld_terminal on a handle that takes escape sequences, as a console would after open()
+class test_vt_terminal : public tp::ld_terminal
+{
+public:
+    explicit test_vt_terminal(HANDLE out) : tp::ld_terminal(out)
+    {
+    }
+    virtual bool open()
+    {
+        bool ok = tp::ld_terminal::open();
+        m_escapes = true;
+        return ok;
+    }
+};
+
+//! opens the gate of a test_gated_log after 50 ms
+inline unsigned int __stdcall test_open_gate_proc(void * param)
+{
+    ::Sleep(50);
+    static_cast<test_gated_log *>(param)->open_gate();
+    return 0;
+}
+
+//! logs 1000 lines "t"
+inline unsigned int __stdcall test_log_proc(void *)
+{
+    for (int i = 0; i < 1000; i++) tp::log(1, "t", false);
+    return 0;
+}
+
+//! line \a i of flight recorder writer \a id, its tail tells a torn line
+inline std::string test_recorder_line(int id, int i)
+{
+    return std::string(tp::czA("w%d %06d ", id, i)) + std::string(30, static_cast<char>('a' + id)) + "\n";
+}
+
+struct test_recorder_writer
+{
+    tp::ld_flight_recorder * fr;
+    int id;
+};
+
+//! writes 20000 lines of test_recorder_line
+inline unsigned int __stdcall test_recorder_proc(void * param)
+{
+    test_recorder_writer * w = static_cast<test_recorder_writer *>(param);
+    for (int i = 0; i < 20000; i++)
+    {
+        std::string line = test_recorder_line(w->id, i);
+        w->fr->write(line.c_str(), line.length(), 0);
+    }
+    return 0;
+}
+
+TPUT_DEFINE_BLOCK(L"log", L"")
+{
+    tp::ld_mem_log * ld = new tp::ld_mem_log;
+    tp::log_add_device(ld, 0xFFFFFFFF, false);
+    std::wstring str;
+
+    tp::log(L"a\nb");
+    ld->get_log(str);
+    TPUT_EXPECT(str == L"a\nb\n", L"multi-line text is split into lines");
+
+    // every alignment of the start against every position of the end, across 16 byte blocks
+    char eol_text[80];
+    bool eol_found = true;
+    for (size_t start = 0; start < 16; start++)
+    {
+        for (size_t end = start; end < start + 48; end++)
+        {
+            memset(eol_text, 'x', sizeof(eol_text));
+            eol_text[end] = (end & 1) ? '\n' : '\0';
+            eol_text[sizeof(eol_text) - 1] = '\0';
+            const char * sse2 = tp::_inner::log_find_eol(eol_text + start);
+            eol_found = eol_found && sse2 == eol_text + end && sse2 == tp::_inner::log_find_eol_scalar(eol_text + start);
+        }
+    }
+    TPUT_EXPECT(eol_found, L"the line end is found at any alignment, the same as byte by byte");
+
+    std::string utf8;
+    tp::log("\xE4\xB8\xAD");
+    ld->get_log(utf8);
+    TPUT_EXPECT(utf8 == "a\nb\n\xE4\xB8\xAD\n", L"UTF-8 text reaches the device unchanged");
+
+    tp::log_remove_device(ld);
+    delete ld;
+}
+
+TPUT_DEFINE_BLOCK(L"log.async", L"")
+{
+    tp::ld_mem_log * ld = new tp::ld_mem_log;
+    tp::log_add_device(ld, 0xFFFFFFFF, false);
+    std::wstring str;
+
+    TPUT_EXPECT(tp::log_start_async(16), L"start async mode");
+    for (int i = 0; i < 100; i++)
+    {
+        tp::log(tp::cz(L"%d", i), false);
+    }
+    tp::tplogger::instance().wait_async_idle();
+    ld->get_log(str);
+    TPUT_EXPECT(str.substr(0, 6) == L"0\n1\n2\n" && str.substr(str.length() - 4) == L"\n99\n", L"async mode keeps the order of one thread");
+
+#if (_MSC_VER >= 1800)
+    tp::log_format(0, L"[%d|%5s|%-3u|%.2f|%*d|%c%%]", 42, "ab", 7u, 1.5, 4, 3, 'x');
+    tp::tplogger::instance().wait_async_idle();
+    ld->get_log(str);
+    TPUT_EXPECT(str.substr(str.length() - 28) == L"[42|   ab|7  |1.50|   3|x%]\n", L"deferred formatting is rendered by the consumer");
+
+    // a narrow format is UTF-8, whatever the ANSI code page and the C locale are
+    std::string utf8;
+    tp::log_format(0, "[%s|%4s]", L"caf\x00e9", L"\x00fc");
+    tp::tplogger::instance().wait_async_idle();
+    ld->get_log(utf8);
+    TPUT_EXPECT(utf8.substr(utf8.length() - 13) == "[caf\xc3\xa9|  \xc3\xbc]\n", L"wide arguments of a narrow format are rendered as UTF-8");
+#endif
+    tp::log_stop_async();
+
+    std::string packed;
+    tp::deferred_args packer(packed);
+    packer.add(42);
+    packer.add("abcdef");
+    packer.add('x');
+    std::string rendered;
+    tp::deferred_render("%d|%s|%c", packed, rendered);
+    std::string truncated;
+    // cut in the middle of the string: its length points past the end
+    tp::deferred_render("%d|%s|%c", packed.c_str(), packed.length() - 12, truncated);
+    TPUT_EXPECT(rendered == "42|abcdef|x" && truncated == "42||%c", L"deferred arguments never read past their buffer");
+
+    tp::log_remove_device(ld);
+    delete ld;
+
+    test_gated_log * gated = new test_gated_log;
+    tp::log_add_device(gated, 0xFFFFFFFF, false);
+    tp::log_add_context(gated, new tp::lc_hrtime(L"%S", 6));
+    tp::log_add_context(gated, new tp::lc_text(L" "));
+    tp::log_start_async(16);
+    gated->close_gate();
+    tp::log(1, "a", false);
+    while (gated->writes() == 0) ::Sleep(1);
+    tp::log(1, "b", false);
+    ::Sleep(100);
+    gated->open_gate();
+    tp::log_stop_async();
+    gated->get_log(str);
+    double delta = (str.length() > 20 ? wcstod(str.c_str() + str.find(L'\n') + 1, NULL) - wcstod(str.c_str(), NULL) : 99);
+    if (delta < 0) delta += 60;
+    TPUT_EXPECT(delta < 0.05, L"queued lines show the time they were logged, not written");
+    tp::log_remove_device(gated);
+    delete gated;
+
+    ld = new tp::ld_mem_log;
+    tp::log_add_device(ld, 0xFFFFFFFF, false);
+    tp::log_add_context(ld, new tp::lc_tid);
+    tp::log_add_context(ld, new tp::lc_text(L"|"));
+    tp::log_add_context(ld, new tp::lc_indent);
+    tp::log_start_async(64);
+    tp::lc_tid::set_thread_name(L"tester");
+    tp::lc_indent::add_indent(2);
+    tp::log(1, "a", false);
+    tp::lc_indent::add_indent(-2);
+    tp::log(1, "b", false);
+    unsigned int producer_tid = 0;
+    HANDLE producer = reinterpret_cast<HANDLE>(::_beginthreadex(NULL, 0, &test_log_proc, NULL, 0, &producer_tid));
+    ::WaitForSingleObject(producer, INFINITE);
+    ::CloseHandle(producer);
+    tp::log_stop_async();
+    ld->get_log(str);
+    std::wstring producer_line = static_cast<const wchar_t *>(tp::cz(L"%04u|t\n", producer_tid));
+    size_t producer_lines = 0;
+    for (size_t pos = str.find(producer_line); pos != std::wstring::npos; pos = str.find(producer_line, pos + 1)) producer_lines++;
+    TPUT_EXPECT(str.substr(0, 20) == L"tester|  a\ntester|b\n" && producer_lines == 1000,
+        L"queued lines show the name, id and indent of the thread that logged them");
+    tp::log_remove_device(ld);
+    delete ld;
+
+    test_hrtime hrtime;
+    hrtime.run_ahead(5000000);
+    unsigned __int64 before_calibration = hrtime.now();
+    hrtime.recalibrate();
+    unsigned __int64 after_calibration = hrtime.now();
+    ::Sleep(20);
+    TPUT_EXPECT(after_calibration >= before_calibration && hrtime.now() > before_calibration,
+        L"high resolution times do not go backwards across a recalibration");
+
+    ld = new tp::ld_mem_log;
+    tp::log_add_device(ld, 0xFFFFFFFF, false);
+    tp::log_start_async(64);
+    HANDLE producers[4];
+    for (int i = 0; i < 4; i++) producers[i] = reinterpret_cast<HANDLE>(::_beginthreadex(NULL, 0, &test_log_proc, NULL, 0, NULL));
+    ::Sleep(1);
+    tp::log_stop_async();
+    ::WaitForMultipleObjects(4, producers, TRUE, INFINITE);
+    for (int i = 0; i < 4; i++) ::CloseHandle(producers[i]);
+    ld->get_log(str);
+    TPUT_EXPECT(std::count(str.begin(), str.end(), L'\n') == 4000, L"stopping async mode while threads log loses no line");
+    tp::log_remove_device(ld);
+    delete ld;
+
+    ld = new tp::ld_mem_log;
+    tp::log_add_device(ld, 0xFFFFFFFF, false);
+    for (int i = 0; i < 4; i++) producers[i] = reinterpret_cast<HANDLE>(::_beginthreadex(NULL, 0, &test_log_proc, NULL, 0, NULL));
+    bool whole_lines = true;
+    int swaps = 0;
+    while (::WaitForMultipleObjects(4, producers, TRUE, 0) == WAIT_TIMEOUT || swaps == 0)
+    {
+        tp::ld_mem_log * extra = new tp::ld_mem_log;
+        tp::log_add_device(extra, 0xFFFFFFFF, false);
+        ::Sleep(0);
+        tp::log_remove_device(extra);
+        std::string extra_text;
+        extra->get_log(extra_text);
+        delete extra;
+        whole_lines = whole_lines && extra_text.length() == 2 * static_cast<size_t>(std::count(extra_text.begin(), extra_text.end(), '\n'));
+        swaps++;
+    }
+    for (int i = 0; i < 4; i++) ::CloseHandle(producers[i]);
+    ld->get_log(str);
+    TPUT_EXPECT(std::count(str.begin(), str.end(), L'\n') == 4000 && whole_lines,
+        L"adding and removing devices while threads log loses no line and tears none");
+    tp::log_remove_device(ld);
+    delete ld;
+}
+
+TPUT_DEFINE_BLOCK(L"log.flush", L"")
+{
+    test_flush_log * counted = new test_flush_log;
+    tp::log_add_device(counted, 0xFFFFFFFF, false);
+    tp::log_set_flush_policy(tp::log_flush_policy(0, 0, false, 1 << 3));
+    tp::log(3, "error", false);
+    tp::log(1, "info", true);
+    TPUT_EXPECT(counted->syncs() == 1 && counted->flushes() == 1, L"forced types are synced even without a flush request");
+    tp::log_set_flush_policy(tp::log_flush_policy(60000, 100));
+    long flushes_before = counted->flushes();
+    for (int i = 0; i < 5; i++) tp::log(1, "123456789", true);
+    bool coalesced = counted->flushes() == flushes_before;
+    for (int i = 0; i < 10; i++) tp::log(1, "123456789", true);
+    TPUT_EXPECT(coalesced && counted->flushes() == flushes_before + 1, L"flush requests are coalesced until max_bytes are pending");
+    tp::log_set_flush_policy(tp::log_flush_policy(50));
+    flushes_before = counted->flushes();
+    tp::log(1, "later", true);
+    for (int i = 0; i < 200 && counted->flushes() == flushes_before; i++) ::Sleep(10);
+    TPUT_EXPECT(counted->flushes() == flushes_before + 1, L"the flusher thread commits pending lines after the interval");
+    tp::log_set_flush_policy(tp::log_flush_policy());
+    tp::log_remove_device(counted);
+    delete counted;
+}
+
+TPUT_DEFINE_BLOCK(L"log.stats", L"")
+{
+    std::wstring str;
+    tp::ld_mem_log * ld = new tp::ld_mem_log;
+    tp::log_add_device(ld, 0x02, false);
+    TPUT_EXPECT(tp::log_enabled(1) && !tp::log_enabled(0), L"the type mask follows the devices");
+    int evaluated = 0;
+    TP_LOG(0, (evaluated++, L"dropped"));
+    TP_LOG(1, (evaluated++, L"kept"));
+    ld->get_log(str);
+    TPUT_EXPECT(str == L"kept\n" && evaluated == 1, L"disabled types skip the arguments");
+    tp::log_remove_device(ld);
+    delete ld;
+
+    ld = new tp::ld_mem_log;
+    tp::log_add_device(ld, 0xFFFFFFFF, false);
+    tp::log_enable_stats(true);
+    tp::log(1, "a\nb");
+    tp::log(2, L"c");
+    tp::log_stats stats;
+    tp::log_get_stats(stats);
+    tp::log_enable_stats(false);
+    TPUT_EXPECT(stats.lines[1] == 2 && stats.bytes[1] == 3 && stats.lines[2] == 1 && stats.devices.size() == 1
+        && stats.devices[0].lines == 3 && stats.devices[0].writes == 2 && stats.enqueue_latency.count() == 2, L"statistics count lines, bytes and calls");
+    tp::log_start_async(64);
+    tp::log_enable_stats(true);
+    for (int i = 0; i < 100; i++) tp::log(1, "0123456789", false);
+    tp::tplogger::instance().wait_async_idle();
+    tp::log_get_stats(stats);
+    tp::log_enable_stats(false);
+    tp::log_stop_async();
+    TPUT_EXPECT(stats.lines[1] == 100 && stats.bytes[1] == 1000 && stats.enqueue_latency.count() == 100,
+        L"statistics of queued lines are counted by the consumer thread");
+    tp::log_remove_device(ld);
+    delete ld;
+}
+
+#if (_MSC_VER >= 1800)
+TPUT_DEFINE_BLOCK(L"log.kv", L"")
+{
+    std::wstring str;
+    tp::ld_mem_log * ld = new tp::ld_mem_log;
+    tp::log_add_device(ld, 0xFFFFFFFF, false);
+    tp::log_kv(1, "login", {"user", "bob"}, {"n", 3}, {"ok", true});
+    ld->get_log(str);
+    TPUT_EXPECT(str == L"login user=\"bob\" n=3 ok=true\n", L"text devices get structured records as text");
+    tp::log_remove_device(ld);
+    delete ld;
+
+    std::string record;
+    tp::log_kv_field fields[] = { tp::log_kv_field("id", 42u), tp::log_kv_field("name", L"x") };
+    tp::log_kv_encode(record, 1, 7, 2, "msg", fields, 2);
+    tp::log_kv_record rec;
+    TPUT_EXPECT(rec.parse(record.c_str(), record.length()) && rec.tid == 7 && rec.type == 2 && rec.msg == "msg"
+        && rec.fields.size() == 2 && rec.fields[0].u == 42 && rec.fields[1].s == "x", L"structured records decode");
+
+    FILE * kv_fp = _wfsopen(L"tplibtest.kv", L"wb", _SH_DENYNO);
+    if (kv_fp)
+    {
+        fwrite(tp::log_kv_file_header::magic(), 1, tp::log_kv_file_header::size, kv_fp);
+        fwrite(record.c_str(), 1, record.length(), kv_fp);
+        unsigned int damaged = 0x7FFFFFF0;
+        fwrite(&damaged, sizeof(damaged), 1, kv_fp);
+        fwrite(record.c_str(), 1, record.length(), kv_fp);
+        fclose(kv_fp);
+    }
+    tp::log_kv_reader kv_reader;
+    bool kv_first = kv_reader.open(L"tplibtest.kv") && kv_reader.next(rec) && rec.msg == "msg";
+    TPUT_EXPECT(kv_first && !kv_reader.next(rec), L"a damaged record size ends the file instead of allocating it");
+    kv_reader.close();
+    ::DeleteFileW(L"tplibtest.kv");
+}
+#endif
+
+TPUT_DEFINE_BLOCK(L"log.queue", L"")
+{
+    std::wstring str;
+    std::string utf8;
+    tp::ld_mem_log * ld = new tp::ld_mem_log;
+    tp::ld_queued * queued = new tp::ld_queued(ld, 16, tp::ld_queued::block, false);
+    tp::log_add_device(queued, 0xFFFFFFFF, false);
+    for (int i = 0; i < 100; i++)
+    {
+        tp::log(tp::cz(L"%d", i), false);
+    }
+    tp::log_remove_device(queued);
+    ld->get_log(str);
+    TPUT_EXPECT(str.substr(0, 4) == L"0\n1\n" && str.substr(str.length() - 4) == L"\n99\n" && queued->dropped() == 0,
+        L"a queued device writes everything in order when blocking");
+    delete queued;
+    delete ld;
+
+    test_gated_log * gated = new test_gated_log;
+    gated->close_gate();
+    queued = new tp::ld_queued(gated, 16, tp::ld_queued::block, false);
+    tp::log_add_device(queued, 0xFFFFFFFF, false);
+    tp::log(1, "stalled", false);
+    for (int i = 0; i < 200 && gated->writes() == 0; i++) ::Sleep(1);
+    for (int i = 0; i < 100000; i++) queued->flush();
+    gated->open_gate();
+    tp::log_remove_device(queued);
+    TPUT_EXPECT(gated->writes() == 1 && gated->flushes() == 1, L"flushes of a stalled queued device coalesce into one");
+    delete queued;
+    delete gated;
+
+    gated = new test_gated_log;
+    gated->close_gate();
+    queued = new tp::ld_queued(gated, 16, tp::ld_queued::block, false);
+    tp::log_add_device(queued, 0xFFFFFFFF, false);
+    tp::log(1, "in flight", false);
+    for (int i = 0; i < 200 && gated->writes() == 0; i++) ::Sleep(1);
+    HANDLE opener = reinterpret_cast<HANDLE>(::_beginthreadex(NULL, 0, &test_open_gate_proc, gated, 0, NULL));
+    queued->crash_flush();
+    gated->get_log(utf8);
+    TPUT_EXPECT(utf8 == "in flight\n", L"a queued device's crash flush waits for the batch being written");
+    ::WaitForSingleObject(opener, INFINITE);
+    ::CloseHandle(opener);
+    tp::log_remove_device(queued);
+    delete queued;
+    delete gated;
+}
+
+TPUT_DEFINE_BLOCK(L"log.limit", L"")
+{
+    std::wstring str;
+    tp::ld_mem_log * ld = new tp::ld_mem_log;
+    tp::log_add_device(ld, 0xFFFFFFFF, false);
+    int evaluated = 0;
+    for (int i = 0; i < 100; i++)
+    {
+        TP_LOG_FIRST(1, 3, (evaluated++, L"first"));
+        TP_LOG_SAMPLE(1, 10, L"sample");
+    }
+    size_t reported = tp::log_limit_report(2);
+    ld->get_log(str);
+    TPUT_EXPECT(evaluated == 3 && reported == 2 && std::count(str.begin(), str.end(), L'\n') == 15,
+        L"limited call sites log the first lines and report the rest");
+    tp::log_remove_device(ld);
+    delete ld;
+}
+
+TPUT_DEFINE_BLOCK(L"log.devices", L"")
+{
+    tp::ld_mmap_file * mapped = new tp::ld_mmap_file(L"tplibtest_mmap.log", 4096);
+    tp::log_add_device(mapped, 0xFFFFFFFF, false);
+    std::string mapped_text;
+    for (int i = 0; i < 600; i++)
+    {
+        tp::log(1, tp::czA("line %03d", i), false);
+        mapped_text += tp::czA("line %03d\n", i);
+    }
+    tp::log_remove_device(mapped);
+    delete mapped;
+    std::string segment0 = test_read_file(L"tplibtest_mmap.log.0000");
+    std::string segment1 = test_read_file(L"tplibtest_mmap.log.0001");
+    TPUT_EXPECT(segment0.length() == 455 * 9 && segment0 + segment1 == mapped_text,
+        L"mapped segments roll at line boundaries and are cut to their content");
+
+    // a restart over the segments of the last run, as after a crash
+    mapped = new tp::ld_mmap_file(L"tplibtest_mmap.log", 4096);
+    tp::log_add_device(mapped, 0xFFFFFFFF, false);
+    tp::log(1, "after the restart", false);
+    tp::log_remove_device(mapped);
+    delete mapped;
+    TPUT_EXPECT(test_read_file(L"tplibtest_mmap.log.0000") == segment0
+        && test_read_file(L"tplibtest_mmap.log.0001") == segment1
+        && test_read_file(L"tplibtest_mmap.log.0002") == "after the restart\n",
+        L"reopening continues after the segments on disk and leaves them alone");
+    ::DeleteFileW(L"tplibtest_mmap.log.0000");
+    ::DeleteFileW(L"tplibtest_mmap.log.0001");
+    ::DeleteFileW(L"tplibtest_mmap.log.0002");
+
+    tp::ld_flight_recorder fr(4, 64, 2);
+    for (int i = 0; i < 6; i++)
+    {
+        fr.record(tp::czA("line %d", i), 6);
+    }
+    std::string snapshot;
+    fr.snapshot(snapshot);
+    TPUT_EXPECT(snapshot == "line 2\nline 3\nline 4\nline 5\n", L"flight recorder keeps the newest lines");
+
+    // four writers on two small rings wrap them over and over while the dump runs
+    tp::ld_flight_recorder shared_fr(8, 64, 2);
+    test_recorder_writer recorder_writers[4];
+    HANDLE recorder_threads[4];
+    for (int i = 0; i < 4; i++)
+    {
+        recorder_writers[i].fr = &shared_fr;
+        recorder_writers[i].id = i;
+        recorder_threads[i] = reinterpret_cast<HANDLE>(::_beginthreadex(NULL, 0, &test_recorder_proc, &recorder_writers[i], 0, NULL));
+    }
+    bool recorder_whole = true;
+    size_t recorder_lines = 0;
+    while (::WaitForMultipleObjects(4, recorder_threads, TRUE, 0) == WAIT_TIMEOUT)
+    {
+        shared_fr.snapshot(snapshot);
+        for (size_t pos = 0; pos < snapshot.length(); )
+        {
+            size_t eol = snapshot.find('\n', pos);
+            std::string line = snapshot.substr(pos, eol == std::string::npos ? std::string::npos : eol + 1 - pos);
+            int id = -1;
+            int n = -1;
+            recorder_whole = recorder_whole && sscanf_s(line.c_str(), "w%d %d", &id, &n) == 2
+                && id >= 0 && id < 4 && line == test_recorder_line(id, n);
+            recorder_lines++;
+            pos = eol == std::string::npos ? snapshot.length() : eol + 1;
+        }
+    }
+    for (int i = 0; i < 4; i++) ::CloseHandle(recorder_threads[i]);
+    TPUT_EXPECT(recorder_whole && recorder_lines > 0, L"a flight recorder dump taken while threads write has only whole lines");
+
+    std::string term_text[2];
+    for (int vt = 0; vt < 2; vt++)
+    {
+        HANDLE term_out = ::CreateFileW(L"tplibtest_term.txt", GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        tp::ld_terminal * term = vt ? new test_vt_terminal(term_out) : new tp::ld_terminal(term_out);
+        term->set_context_attr(tp::LCID_TYPE, FOREGROUND_RED | FOREGROUND_INTENSITY);
+        tp::log_add_device(term, 0xFFFFFFFF, false);
+        tp::log_add_context(term, new tp::lc_type(L"DIWE"));
+        tp::log_add_context(term, new tp::lc_text(L" "));
+        tp::log(3, "failed", false);
+        tp::log(1, "done", false);
+        tp::log_remove_device(term);
+        delete term;
+        if (term_out != INVALID_HANDLE_VALUE) ::CloseHandle(term_out);
+        term_text[vt] = test_read_file(L"tplibtest_term.txt");
+    }
+    ::DeleteFileW(L"tplibtest_term.txt");
+    TPUT_EXPECT(term_text[0] == "E| failed\nI| done\n", L"a redirected terminal gets the text without escapes");
+    TPUT_EXPECT(term_text[1] == "\x1b[91mE|\x1b[0m failed\n\x1b[91mI|\x1b[0m done\n", L"terminal contexts are colored with escape sequences");
+}
+
+TPUT_DEFINE_BLOCK(L"log.index", L"")
+{
+    tp::ld_file * file = new tp::ld_file(L"tplibtest_index.log");
+    file->enable_index(1);
+    tp::log_add_device(file, 0xFFFFFFFF, false);
+    for (int i = 0; i < 10; i++) tp::log(1, tp::czA("first %d", i), false);
+    ::Sleep(50);
+    unsigned __int64 between = tp::log_index::now();
+    ::Sleep(50);
+    for (int i = 0; i < 10; i++) tp::log(1, tp::czA("second %d", i), false);
+    tp::log_remove_device(file);
+    delete file;
+    tp::log_index index;
+    std::string indexed = test_read_file(L"tplibtest_index.log");
+    std::string around;
+    bool index_read = index.load(L"tplibtest_index.log") && index.read_range(between, between, around);
+    around.erase(std::remove(around.begin(), around.end(), '\r'), around.end());
+    unsigned __int64 seek = index.find_end(between);
+    TPUT_EXPECT(index_read && index.size() == 20 && seek < indexed.length() && indexed.compare(static_cast<size_t>(seek), 8, "second 0") == 0
+        && around == "first 9\n", L"the time index seeks to the lines logged around a time");
+    ::DeleteFileW(L"tplibtest_index.log");
+    ::DeleteFileW(tp::log_index_name(L"tplibtest_index.log").c_str());
+}
+
+TPUT_DEFINE_BLOCK(L"log.search", L"")
+{
+    tp::ld_file * file = new tp::ld_file(L"tplibtest_search.log");
+    tp::log_add_device(file, 0xFFFFFFFF, false);
+    tp::log_add_context(file, new tp::lc_type(L"DIWE"));
+    tp::log_add_context(file, new tp::lc_text(L" "));
+    for (int i = 0; i < 100; i++)
+    {
+        tp::log(i % 4, i % 10 == 0 ? tp::cz(L"line %d timeout", i) : tp::cz(L"line %d", i));
+    }
+    tp::log_remove_device(file);
+    delete file;
+
+    tp::log_search_query query;
+    query.layout.add(tp::LCID_TYPE, '|');
+    query.where(tp::LCID_TYPE, "W|");
+    query.text = "timeout";
+    std::vector<std::wstring> files(1, L"tplibtest_search.log");
+    std::vector<tp::log_search_match> found;
+    tp::log_search(files, query, found);
+    TPUT_EXPECT(found.size() == 5 && found[0].line == "W| line 10 timeout" && found[4].line == "W| line 90 timeout",
+        L"search filters by context fields and text");
+    ::DeleteFileW(L"tplibtest_search.log");
+}
+
+TPUT_DEFINE_BLOCK(L"log.files", L"")
+{
+    ::DeleteFileW(L"tplibtest_rot.log");
+    // files of other devices next to the log, retention must not count or delete them
+    const wchar_t * rot_others[] = { L"tplibtest_rot.log.lz", L"tplibtest_rot.log.0000", L"tplibtest_rot.log.20261017-103200.bak" };
+    for (size_t i = 0; i < sizeof(rot_others)/sizeof(rot_others[0]); i++)
+    {
+        FILE * other = _wfsopen(rot_others[i], L"wb", _SH_DENYNO);
+        if (other) fclose(other);
+    }
+    test_rotating_file * rot = new test_rotating_file(L"tplibtest_rot.log", 1000, 2);
+    tp::log_add_device(rot, 0xFFFFFFFF, false);
+    std::string rot_plain;
+    for (int i = 0; i < 350; i++)
+    {
+        tp::log(1, tp::czA("line %04d", i), false);
+        rot_plain += tp::czA("line %04d\n", i);
+    }
+    tp::log_remove_device(rot);
+    std::vector<std::wstring> rotated = rot->rotated_files();
+    bool rot_sizes = rotated.size() == 2;
+    std::string rot_text;
+    for (size_t i = 0; i < rotated.size(); i++)
+    {
+        std::string part = test_read_file(rotated[i].c_str());
+        rot_sizes = rot_sizes && part.length() >= 1000 && part.length() < 1000 + 11;
+        rot_text += part;
+        ::DeleteFileW(rotated[i].c_str());
+    }
+    rot_text += test_read_file(L"tplibtest_rot.log");
+    rot_text.erase(std::remove(rot_text.begin(), rot_text.end(), '\r'), rot_text.end());
+    TPUT_EXPECT(rot_sizes, L"files rotate at max_size bytes and only keep are left");
+    bool others_kept = true;
+    for (size_t i = 0; i < sizeof(rot_others)/sizeof(rot_others[0]); i++)
+    {
+        others_kept = others_kept && ::GetFileAttributesW(rot_others[i]) != INVALID_FILE_ATTRIBUTES;
+        ::DeleteFileW(rot_others[i]);
+    }
+    TPUT_EXPECT(others_kept, L"retention only counts and deletes the files the device rotated");
+    TPUT_EXPECT(rot_text.length() > 2000 && rot_plain.compare(rot_plain.length() - rot_text.length(), rot_text.length(), rot_text) == 0,
+        L"the kept files hold the tail of the log without gaps");
+    delete rot;
+    ::DeleteFileW(L"tplibtest_rot.log");
+
+    tp::ld_compressed_file * lz = new tp::ld_compressed_file(L"tplibtest_lz.log", 0, 0, 0, 4096);
+    tp::log_add_device(lz, 0xFFFFFFFF, false);
+    std::string plain;
+    for (int i = 0; i < 1000; i++)
+    {
+        tp::log(1, tp::czA("request %d done", i));
+        plain += tp::czA("request %d done\n", i);
+    }
+    tp::log_remove_device(lz);
+    delete lz;
+
+    tp::log_lz_reader lz_reader;
+    std::string block;
+    std::string unpacked;
+    if (lz_reader.open(L"tplibtest_lz.log"))
+    {
+        while (lz_reader.next(block)) unpacked += block;
+        lz_reader.close();
+    }
+    tp::log_index blocks;
+    TPUT_EXPECT(unpacked == plain && blocks.load(L"tplibtest_lz.log") && blocks.size() > 1,
+        L"compressed file blocks decompress to the log text");
+    ::DeleteFileW(L"tplibtest_lz.log");
+    ::DeleteFileW(tp::log_index_name(L"tplibtest_lz.log").c_str());
+
+    // a stored block, then a raw size above the maximum or a size past the end of the file
+    bool lz_damaged = true;
+    for (int i = 0; i < 2; i++)
+    {
+        FILE * lz_fp = _wfsopen(L"tplibtest_lzbad.log", L"wb", _SH_DENYNO);
+        if (lz_fp)
+        {
+            fwrite(tp::log_lz_file_header::magic(), 1, tp::log_lz_file_header::size, lz_fp);
+            tp::log_lz_block_header bh;
+            bh.raw_size = 4;
+            bh.size = 4 | tp::log_lz_block_header::stored;
+            fwrite(&bh, sizeof(bh), 1, lz_fp);
+            fwrite("abc\n", 1, 4, lz_fp);
+            bh.raw_size = i == 0 ? 0x7FFFFFF0 : 0x2000000;
+            bh.size = i == 0 ? 4 : 0x1000000;
+            fwrite(&bh, sizeof(bh), 1, lz_fp);
+            fwrite("abc\n", 1, 4, lz_fp);
+            fclose(lz_fp);
+        }
+        bool lz_first = lz_reader.open(L"tplibtest_lzbad.log") && lz_reader.next(block) && block == "abc\n";
+        lz_damaged = lz_damaged && lz_first && !lz_reader.next(block);
+        lz_reader.close();
+    }
+    TPUT_EXPECT(lz_damaged, L"a damaged block size ends the compressed file instead of allocating it");
+    ::DeleteFileW(L"tplibtest_lzbad.log");
+
+    test_compressed_file * lz_rot = new test_compressed_file(L"tplibtest_lzrot.log", 2000);
+    tp::log_add_device(lz_rot, 0xFFFFFFFF, false);
+    for (int i = 0; i < 5000; i++) tp::log(1, tp::czA("request %d done", i), false);
+    tp::log_remove_device(lz_rot);
+    rotated = lz_rot->rotated_files();
+    bool lz_sizes = rotated.size() >= 2;
+    for (size_t i = 0; i < rotated.size(); i++)
+    {
+        lz_sizes = lz_sizes && test_read_file(rotated[i].c_str()).length() >= 2000;
+        ::DeleteFileW(rotated[i].c_str());
+        ::DeleteFileW(tp::log_index_name(rotated[i]).c_str());
+    }
+    TPUT_EXPECT(lz_sizes, L"compressed files rotate at max_size compressed bytes");
+    delete lz_rot;
+    ::DeleteFileW(L"tplibtest_lzrot.log");
+    ::DeleteFileW(tp::log_index_name(L"tplibtest_lzrot.log").c_str());
+}
+
+TPUT_DEFINE_BLOCK(L"log.crash", L"")
+{
+    std::string utf8;
+    std::string block;
+    std::string unpacked;
+    tp::log_lz_reader lz_reader;
+
+    tp::ld_file * file = new tp::ld_file(L"tplibtest_crash.log");
+    tp::log_add_device(file, 0xFFFFFFFF, false);
+    // the crashing thread holds the lock of this one, as if it crashed in the middle of a write
+    test_rotating_file * rot = new test_rotating_file(L"tplibtest_crashrot.log", 0, 0);
+    tp::log_add_device(rot, 0xFFFFFFFF, false);
+    tp::log(1, "before the crash", false);
+    rot->file_lock().lock();
+    tp::log_crash_drain(1, "crash", 0);
+    rot->file_lock().unlock();
+    std::string crash_text;
+    FILE * fp = _wfsopen(L"tplibtest_crash.log", L"rb", _SH_DENYNO);
+    if (fp)
+    {
+        char buf[64];
+        crash_text.assign(buf, fread(buf, 1, sizeof(buf), fp));
+        fclose(fp);
+    }
+    TPUT_EXPECT(crash_text == "before the crash\ncrash\n" || crash_text == "before the crash\r\ncrash\r\n",
+        L"the crash drain pushes buffered lines to the file");
+    tp::log_remove_device(rot);
+    delete rot;
+    crash_text = test_read_file(L"tplibtest_crashrot.log");
+    TPUT_EXPECT(crash_text == "before the crash\n" || crash_text == "before the crash\r\n",
+        L"the crash line skips a device whose lock the crashing thread holds");
+    tp::log_remove_device(file);
+    delete file;
+    ::DeleteFileW(L"tplibtest_crash.log");
+    ::DeleteFileW(L"tplibtest_crashrot.log");
+
+    // the handler writes its line once per process, this is the only call
+    tp::ld_mem_log * ld = new tp::ld_mem_log;
+    tp::log_add_device(ld, 0xFFFFFFFF, false);
+    tp::ld_compressed_file * lz = new tp::ld_compressed_file(L"tplibtest_lzcrash.log", 0, 0, 0, 64 * 1024, 60000);
+    tp::log_add_device(lz, 0xFFFFFFFF, false);
+    tp::log_enable_crash_drain(1, 0);
+    tp::log(1, "before the crash", false);
+    {
+        OPBLOCK(L"load config");
+        OPBLOCK(L"parse");
+        tp::_inner::log_crash_write("crash: test");
+    }
+    ld->get_log(utf8);
+    std::string crash_ops = static_cast<const char *>(tp::czA("crash: test, thread %lu, ops: load config -> parse\n", ::GetCurrentThreadId()));
+    if (lz_reader.open(L"tplibtest_lzcrash.log"))
+    {
+        while (lz_reader.next(block)) unpacked += block;
+        lz_reader.close();
+    }
+    TPUT_EXPECT(unpacked == "before the crash\n" + crash_ops,
+        L"the crash line names the ops of the crashing thread, compressed blocks are stored");
+    TPUT_EXPECT(utf8 == "before the crash\n", L"the crash line is not written to a device that would allocate");
+    tp::log_remove_device(lz);
+    delete lz;
+    tp::log_remove_device(ld);
+    delete ld;
+    ::DeleteFileW(L"tplibtest_lzcrash.log");
+    ::DeleteFileW(tp::log_index_name(L"tplibtest_lzcrash.log").c_str());
+}
+
+TPUT_DEFINE_BLOCK(L"log.pipe", L"")
+{
+    tp::ld_pipe * shipper = new tp::ld_pipe(L"\\\\.\\pipe\\tplibtest_log", 64, 1024, 10000, 10);
+    tp::log_add_device(shipper, 0xFFFFFFFF, false);
+    // no flush, the sender stays asleep until the collector is there
+    for (int i = 0; i < 10; i++) tp::log(1, tp::czA("line %d", i), false);
+    long dropped = shipper->dropped();
+    HANDLE collector = ::CreateNamedPipeW(L"\\\\.\\pipe\\tplibtest_log", PIPE_ACCESS_INBOUND,
+        PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT, 1, 0, 4096, 0, NULL);
+    shipper->flush();
+    std::string shipped;
+    if (collector != INVALID_HANDLE_VALUE)
+    {
+        char buf[4096];
+        DWORD n = 0;
+        if ((::ConnectNamedPipe(collector, NULL) || ::GetLastError() == ERROR_PIPE_CONNECTED)
+            && ::ReadFile(collector, buf, sizeof(buf), &n, NULL)) shipped.assign(buf, n);
+    }
+    for (int i = 0; i < 100 && shipper->sent() < 9; i++) ::Sleep(10);
+    TPUT_EXPECT(dropped == 1 && shipped == "line 0\nline 1\nline 2\nline 3\nline 4\nline 5\nline 6\nline 7\nline 8\n"
+        && shipper->sent() == 9 && shipper->connects() == 1, L"the pipe device buffers until the collector is there and drops what does not fit");
+    tp::log_remove_device(shipper);
+    delete shipper;
+    if (collector != INVALID_HANDLE_VALUE) ::CloseHandle(collector);
+
+    shipper = new tp::ld_pipe(L"\\\\.\\pipe\\tplibtest_nobody", 64, 1024, 10000, 10);
+    tp::log_add_device(shipper, 0xFFFFFFFF, false);
+    for (int i = 0; i < 9; i++) tp::log(1, tp::czA("line %d", i), false);
+    // the sender takes the lines and finds no collector, they still count against the capacity
+    shipper->flush();
+    ::Sleep(50);
+    for (int i = 0; i < 9; i++) tp::log(1, tp::czA("line %d", i), false);
+    TPUT_EXPECT(shipper->dropped() == 9 && shipper->pending() == 9 && shipper->sent() == 0,
+        L"the pipe device buffers at most capacity bytes, with or without a collector");
+    tp::log_remove_device(shipper);
+    delete shipper;
+}